@@ -0,0 +1,322 @@
+// In-process benchmark for the filesystem callbacks.
+//
+// Builds main_fs.c into this program (without its main) and drives the
+// same operation table libfuse would, with no kernel mount involved, so
+// the numbers show the daemon's own cost. Each workload runs at every
+// requested thread count on one fresh image in a temporary directory, and
+// prints one JSON object per line: throughput plus latency percentiles.
+//
+//   ./bench_fs [-t 1,2,4,8] [-s 16M] [-n 1000] [-w seqwrite,...] [-o mount options]
+//
+// Workloads: seqwrite, seqread, randread, randwrite (4 KB), create (small
+// files), stat (getattr loop). Mount options are the daemon's own, e.g.
+// -o cache_size=0 or -o io_engine=io_uring,mmap.
+
+#define FS_NO_MAIN
+#include "main_fs.c"
+
+#define BENCH_IO_SIZE   (128 * 1024)     // sequential request size
+#define BENCH_RAND_SIZE 4096
+#define BENCH_MAX_THREADS 256
+
+static const char *const g_workloads[] = {
+    "seqwrite", "seqread", "randread", "randwrite", "create", "stat",
+};
+#define NWORKLOADS (sizeof(g_workloads) / sizeof(g_workloads[0]))
+
+// What each workload reads or stats has to exist first.
+static const int g_needs[NWORKLOADS] = { -1, 0, 0, 0, -1, 4 };
+
+static struct {
+    uint64_t file_size;                  // per thread, for the I/O workloads
+    uint32_t small_files;                // per thread, for create and stat
+    int      workload;                   // index into g_workloads
+    int      threads;                    // of this run; part of every name
+    pthread_barrier_t start;
+} g_bench;
+
+typedef struct {
+    pthread_t thread;
+    int       id;
+    char      file[64];                  // this thread's big file
+    char      dir[64];                   // and its directory of small files
+    uint64_t  ops;
+    uint64_t  bytes;
+    uint64_t  errors;
+    uint64_t  hist[STATS_BUCKETS];
+    uint64_t  max_ns;
+    uint64_t  seed;
+} Worker;
+
+static uint64_t bench_rand(uint64_t *s) {
+    // xorshift64*
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static void bench_note(Worker *w, uint64_t t0, int ret, uint64_t bytes) {
+    uint64_t ns = stats_now() - t0;
+    w->ops++;
+    w->hist[stats_bucket(ns)]++;
+    w->max_ns = ns > w->max_ns ? ns : w->max_ns;
+    if (ret < 0) {
+        w->errors++;
+    } else {
+        w->bytes += bytes;
+    }
+}
+
+static void bench_io(Worker *w, char *buf) {
+    const char *path = w->file;
+    int wl = g_bench.workload;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = wl == 1 || wl == 2 ? O_RDONLY : O_RDWR;
+    if (my_oper.open(path, &fi) < 0) {
+        w->errors++;
+        return;
+    }
+
+    uint64_t blocks = g_bench.file_size / BENCH_RAND_SIZE;
+    uint64_t n = wl <= 1 ? g_bench.file_size / BENCH_IO_SIZE : blocks;
+    for (uint64_t i = 0; i < n; i++) {
+        off_t off = wl <= 1 ? (off_t)(i * BENCH_IO_SIZE)
+                            : (off_t)(bench_rand(&w->seed) % blocks) * BENCH_RAND_SIZE;
+        size_t len = wl <= 1 ? BENCH_IO_SIZE : BENCH_RAND_SIZE;
+        uint64_t t0 = stats_now();
+        int ret = wl == 0 || wl == 3 ? my_oper.write(path, buf, len, off, &fi)
+                                     : my_oper.read(path, buf, len, off, &fi);
+        bench_note(w, t0, ret, ret > 0 ? ret : 0);
+    }
+    my_oper.release(path, &fi);
+}
+
+static void bench_meta(Worker *w, char *buf) {
+    char path[96];
+    for (uint32_t i = 0; i < g_bench.small_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%u", w->dir, i);
+        uint64_t t0 = stats_now();
+        int ret;
+        if (g_bench.workload == 4) {
+            struct fuse_file_info fi;
+            memset(&fi, 0, sizeof(fi));
+            fi.flags = O_RDWR | O_CREAT;
+            ret = my_oper.create(path, S_IFREG | 0644, &fi);
+            if (ret == 0) {
+                ret = my_oper.write(path, buf, BENCH_RAND_SIZE, 0, &fi);
+                my_oper.release(path, &fi);
+            }
+            bench_note(w, t0, ret, ret > 0 ? ret : 0);
+        } else {
+            struct stat st;
+            ret = my_oper.getattr(path, &st, NULL);
+            bench_note(w, t0, ret, 0);
+        }
+    }
+}
+
+static void *bench_worker(void *arg) {
+    Worker *w = arg;
+    char *buf = malloc(BENCH_IO_SIZE);
+    if (buf == NULL) {
+        fatal("Out of memory");
+    }
+    memset(buf, 'a' + w->id % 26, BENCH_IO_SIZE);
+
+    pthread_barrier_wait(&g_bench.start);
+    if (g_bench.workload < 4) {
+        bench_io(w, buf);
+    } else {
+        bench_meta(w, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Run the current workload once on g_bench.threads threads. With out NULL
+// the run only sets up what a later workload needs, and isn't reported.
+static void bench_run(FILE *out) {
+    static Worker workers[BENCH_MAX_THREADS];
+    int threads = g_bench.threads;
+
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < threads; t++) {
+        Worker *w = &workers[t];
+        w->id = t;
+        w->seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        snprintf(w->file, sizeof(w->file), "/t%d.b%d", threads, t);
+        snprintf(w->dir, sizeof(w->dir), "/t%d.d%d", threads, t);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        if (g_bench.workload == 0 && my_oper.create(w->file, S_IFREG | 0644, &fi) == 0) {
+            my_oper.release(w->file, &fi);
+        }
+        if (g_bench.workload == 4) {
+            my_oper.mkdir(w->dir, 0755);
+        }
+    }
+
+    pthread_barrier_init(&g_bench.start, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, bench_worker, &workers[t]) != 0) {
+            fatal("Failed to start benchmark thread");
+        }
+    }
+    pthread_barrier_wait(&g_bench.start);
+    uint64_t t0 = stats_now();
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double secs = (stats_now() - t0) / 1e9;
+    pthread_barrier_destroy(&g_bench.start);
+    if (out == NULL) {
+        return;
+    }
+
+    // Merge the per-thread histograms into the first one.
+    Worker *sum = &workers[0];
+    for (int t = 1; t < threads; t++) {
+        sum->ops += workers[t].ops;
+        sum->bytes += workers[t].bytes;
+        sum->errors += workers[t].errors;
+        sum->max_ns = workers[t].max_ns > sum->max_ns ? workers[t].max_ns : sum->max_ns;
+        for (uint32_t b = 0; b < STATS_BUCKETS; b++) {
+            sum->hist[b] += workers[t].hist[b];
+        }
+    }
+    fprintf(out, "{\"workload\":\"%s\",\"threads\":%d,\"ops\":%llu,\"errors\":%llu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+            "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+            g_workloads[g_bench.workload], threads,
+            (unsigned long long)sum->ops, (unsigned long long)sum->errors, secs,
+            secs > 0 ? sum->ops / secs : 0.0,
+            secs > 0 ? sum->bytes / secs / (1024 * 1024) : 0.0,
+            stats_percentile(sum->hist, sum->ops, 0.50, sum->max_ns) / 1e3,
+            stats_percentile(sum->hist, sum->ops, 0.90, sum->max_ns) / 1e3,
+            stats_percentile(sum->hist, sum->ops, 0.99, sum->max_ns) / 1e3,
+            stats_percentile(sum->hist, sum->ops, 0.999, sum->max_ns) / 1e3,
+            sum->max_ns / 1e3);
+    fflush(out);
+}
+
+// Format a fresh image in the current directory and start the daemon's
+// threads, as mounting would.
+static void bench_mount(struct fuse_args *args) {
+    struct fuse_conn_info conn;
+    struct fuse_config cfg;
+
+    if (fuse_opt_parse(args, &g_opts, option_spec, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    g_opts.mkfs = 1;
+    log_setup();
+    io_engine_select();
+    fs_init();
+    cache_setup();
+    chunk_setup();
+    dedup_setup();
+
+    memset(&conn, 0, sizeof(conn));
+    memset(&cfg, 0, sizeof(cfg));
+    my_oper.init(&conn, &cfg);
+}
+
+static void bench_unmount(void) {
+    my_oper.destroy(NULL);
+    unlink(FS_FILENAME);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench_fs [-t threads,...] [-s file_size] [-n small_files]\n"
+                    "                [-w workload,...] [-o mount_options]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *thread_list = "1,2,4,8";
+    const char *workload_list = NULL;
+    g_bench.file_size = 16 * 1024 * 1024;
+    g_bench.small_files = 1000;
+
+    // Everything but -o is ours; -o goes to the daemon's option parser.
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    fuse_opt_add_arg(&args, argv[0]);
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        if (strcmp(argv[i], "-t") == 0) {
+            thread_list = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0) {
+            g_bench.file_size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            g_bench.small_files = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            workload_list = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            fuse_opt_add_arg(&args, "-o");
+            fuse_opt_add_arg(&args, argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (g_bench.file_size < BENCH_IO_SIZE) {
+        usage();
+    }
+
+    // Results go to stdout; the daemon's own messages go to stderr.
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    char dir[] = "/tmp/bench_fs.XXXXXX";
+    if (out == NULL || mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        fatal("Cannot set up a scratch directory");
+    }
+
+    uint64_t total_threads = 0;
+    for (const char *p = thread_list; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : "") {
+        int t = atoi(p);
+        if (t < 1 || t > BENCH_MAX_THREADS) {
+            usage();
+        }
+        total_threads += t;
+    }
+
+    // Every run keeps its files, so the image holds all of them, with
+    // slack for the allocator.
+    char geometry[64];
+    uint64_t bytes = total_threads * (g_bench.file_size + (uint64_t)g_bench.small_files * BLOCK_SIZE);
+    snprintf(geometry, sizeof(geometry), "size=%llu,max_files=%llu",
+             (unsigned long long)(bytes + bytes / 4 + 64 * 1024 * 1024),
+             (unsigned long long)(total_threads * (g_bench.small_files + 2) + 64));
+    fuse_opt_add_arg(&args, "-o");
+    fuse_opt_add_arg(&args, geometry);
+
+    bench_mount(&args);
+    for (const char *p = thread_list; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : "") {
+        g_bench.threads = atoi(p);
+        int done[NWORKLOADS] = { 0 };
+        for (int wl = 0; wl < (int)NWORKLOADS; wl++) {
+            if (workload_list != NULL && !strstr(workload_list, g_workloads[wl])) {
+                continue;
+            }
+            if (g_needs[wl] >= 0 && !done[g_needs[wl]]) {
+                g_bench.workload = g_needs[wl];
+                bench_run(NULL);
+                done[g_needs[wl]] = 1;
+            }
+            g_bench.workload = wl;
+            bench_run(out);
+            done[wl] = 1;
+        }
+    }
+    bench_unmount();
+
+    fuse_opt_free_args(&args);
+    chdir("/");
+    rmdir(dir);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#!/bin/bash
+
+# Mounted benchmark suite for main_fs
+#
+# Mounts a fresh image and runs standard fio jobs through the kernel:
+# sequential read/write at 4K, 64K and 1M, 70/30 random read/write,
+# fsync after every 4K write, and a metadata pass that creates, stats and
+# deletes many small files. Everything runs twice, once with libfuse's
+# single-threaded loop (-s) and once multithreaded. One JSON object per
+# job goes to stdout (fio's full report under "fio"); progress goes to
+# stderr.
+#
+#   ./bench_mount.sh [-o mount_options] [-S size_mb] [-j jobs] [-n files] [-t seconds]
+#
+# To compare settings, run it once per option set:
+#
+#   for o in "" cache_size=0 io_engine=io_uring no_writeback max_write=128K; do
+#       ./bench_mount.sh -o "$o"
+#   done > results.jsonl
+
+set -u
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+MAIN_FS="$SCRIPT_DIR/main_fs"
+OPTS=""
+SIZE_MB=256         # per fio job
+JOBS=4              # fio processes per job
+NFILES=10000        # small files in the metadata pass, over all jobs
+RUNTIME=30          # cap per fio job, in seconds
+
+usage() {
+    echo "usage: $0 [-o mount_options] [-S size_mb] [-j jobs] [-n files] [-t seconds]" >&2
+    exit 1
+}
+
+while getopts "o:S:j:n:t:" opt; do
+    case $opt in
+        o) OPTS=$OPTARG ;;
+        S) SIZE_MB=$OPTARG ;;
+        j) JOBS=$OPTARG ;;
+        n) NFILES=$OPTARG ;;
+        t) RUNTIME=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+command -v fio >/dev/null || { echo "fio is not installed" >&2; exit 1; }
+[ -x "$MAIN_FS" ] || { echo "$MAIN_FS not found; run make first" >&2; exit 1; }
+
+WORK_DIR=$(mktemp -d /tmp/bench_mount.XXXXXX)
+MOUNT_POINT="$WORK_DIR/mnt"
+mkdir -p "$MOUNT_POINT"
+FS_PID=""
+
+# Room for every job's data file and the small files, with some slack
+IMAGE_MB=$(( (JOBS * SIZE_MB + NFILES * 4 / 1024) * 5 / 4 + 64 ))
+MAX_FILES=$(( NFILES + JOBS * 4 + 64 ))
+
+REVISION=$(git -C "$SCRIPT_DIR" describe --always --dirty 2>/dev/null || echo unknown)
+KERNEL=$(uname -r)
+
+json_str() {
+    printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g'
+}
+
+unmount_fs() {
+    if mountpoint -q "$MOUNT_POINT"; then
+        fusermount3 -u "$MOUNT_POINT" 2>/dev/null || fusermount -u "$MOUNT_POINT"
+    fi
+    if [ -n "$FS_PID" ]; then
+        wait "$FS_PID" 2>/dev/null
+        FS_PID=""
+    fi
+}
+
+cleanup() {
+    unmount_fs
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Mount a fresh filesys.db; $1 is -s for the single-threaded loop, or empty
+mount_fs() {
+    rm -f "$WORK_DIR/filesys.db"
+    (cd "$WORK_DIR" && exec "$MAIN_FS" -f ${1:+"$1"} \
+        -o "mkfs,size=${IMAGE_MB}M,max_files=$MAX_FILES${OPTS:+,$OPTS}" \
+        "$MOUNT_POINT") > "$WORK_DIR/main_fs.log" 2>&1 &
+    FS_PID=$!
+
+    for _ in $(seq 100); do
+        mountpoint -q "$MOUNT_POINT" && return 0
+        sleep 0.1
+    done
+    echo "main_fs did not mount:" >&2
+    cat "$WORK_DIR/main_fs.log" >&2
+    exit 1
+}
+
+# Run one fio job; $1 = mode, $2 = job name, the rest are fio arguments
+run_job() {
+    local mode=$1 name=$2
+    shift 2
+    echo "[$mode] $name" >&2
+    if ! fio --name="$name" --directory="$MOUNT_POINT" --numjobs="$JOBS" \
+             --group_reporting --runtime="$RUNTIME" \
+             --output-format=json --output="$WORK_DIR/fio.json" "$@" >&2; then
+        echo "[$mode] $name failed" >&2
+        return
+    fi
+    printf '{"suite":"main_fs","revision":"%s","kernel":"%s","mode":"%s","options":"%s","jobs":%d,"job":"%s","fio":%s}\n' \
+        "$(json_str "$REVISION")" "$(json_str "$KERNEL")" "$mode" "$(json_str "$OPTS")" \
+        "$JOBS" "$name" "$(tr -d '\n' < "$WORK_DIR/fio.json")"
+}
+
+for mode in multithreaded single; do
+    mount_fs "$([ $mode = single ] && echo -s)"
+
+    # The data jobs share one file per fio process, laid out by the first
+    DATA=(--ioengine=psync --size="${SIZE_MB}M" --filename_format='data.$jobnum')
+    for bs in 4k 64k 1m; do
+        run_job $mode "seqwrite-$bs" "${DATA[@]}" --rw=write --bs=$bs
+        run_job $mode "seqread-$bs" "${DATA[@]}" --rw=read --bs=$bs
+    done
+    run_job $mode randrw-4k "${DATA[@]}" --rw=randrw --rwmixread=70 --bs=4k
+    run_job $mode fsync-4k "${DATA[@]}" --rw=randwrite --bs=4k --fsync=1
+
+    # Metadata: the same small files are created, stat()ed, then deleted
+    META=(--filesize=4k --nrfiles=$(( NFILES / JOBS )) --openfiles=1
+          --filename_format='meta.$jobnum.$filenum')
+    run_job $mode create "${META[@]}" --ioengine=filecreate --fallocate=none
+    run_job $mode stat "${META[@]}" --ioengine=filestat --stat_type=stat
+    run_job $mode unlink "${META[@]}" --ioengine=filedelete
+
+    unmount_fs
+done
@@ -1,51 +1,525 @@
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 31
 
 #include <fuse3/fuse.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define FS_FILENAME    "filesys.db"
-#define FS_SIZE        (1024 * 1024)   // 1 MB
+#define FS_DEFAULT_SIZE (1024 * 1024)  // 1 MB unless -o size= is given at mkfs
 
 #define FS_MAGIC       0xDEADBEEF
-#define FS_VERSION     1
+#define FS_VERSION     8
 
-#define MAX_FILES      64
+#define JOURNAL_MAGIC  0x4A524E4C      // "JRNL"
+#define JOURNAL_SIZE   (64 * 1024)     // append-only metadata log
+#define JOURNAL_CHECKPOINT_SECS 5      // max age of un-checkpointed records
+#define JOURNAL_BATCH_MS 5             // max time a record waits to be written
+#define JOURNAL_BATCH  32              // records that wake the committer early
+
+#define MIN_FILES      64              // file table slots on small volumes
+#define BYTES_PER_FILE (64 * 1024)     // default table size: one slot per 64 KB
 #define NAME_MAX_LEN   32
 
+#undef BLOCK_SIZE                      // linux/fs.h (via io_uring.h) has its own
+#define BLOCK_SIZE     4096            // fixed; recorded in the superblock
+#define DIRECT_EXTENTS 8               // extents stored in the FileEntry itself
+#define OVERFLOW_EXTENTS ((BLOCK_SIZE - sizeof(uint32_t)) / sizeof(Extent))  // per chain link
+#define INLINE_MAX     256             // files up to this size live in the FileEntry
+
+// Kernel cache tuning. This daemon is the only writer to the image, so
+// nothing changes behind the kernel's back and long timeouts are safe.
+#define ATTR_TIMEOUT     60.0          // seconds
+#define ENTRY_TIMEOUT    60.0
+#define NEGATIVE_TIMEOUT 60.0
+#define MAX_WRITE        (1024 * 1024) // bytes per write request
+#define MAX_READAHEAD    (1024 * 1024)
+
+#define GROW_MIN_BLOCKS 256            // grow the image by at least 1 MB
+#define MMAP_RESERVE   (1ULL << 40)    // address space kept for the mapping
+
+typedef struct {
+    uint32_t lblk;                       // first logical block of the run
+    uint32_t pblk;                       // first physical block in the image
+    uint32_t len;                        // length in blocks
+} Extent;
+
 #pragma pack(push, 1)
 typedef struct {
     uint32_t magic;
     uint32_t version;
-    uint32_t last_alloc;   // address of last used byte
+    uint64_t last_alloc;   // end of the highest allocated block
     uint32_t file_count;   // number of active files
+    uint32_t journal_gen;  // generation of the records currently in the journal
+    uint32_t block_size;   // always BLOCK_SIZE for now
+    uint32_t block_count;  // current size of the image in blocks
+    uint32_t max_blocks;   // online growth stops here
+    uint32_t max_files;    // slots in the file table
+    uint32_t data_start;   // first block past the table, journal and chunk map
+    uint32_t map_chunks;   // chunks covered by the chunk map
+    uint32_t table_high;   // no slot at or above this one was in use at the checkpoint
+    uint32_t clean;        // 1 after an orderly unmount, 0 while mounted
 } Superblock;
 
+// On-disk and journal form of a file table slot. In memory the table is
+// kept split up instead (see FileMeta below).
 typedef struct {
     uint8_t  used;                       // 1 if this entry is used
-    char     name[NAME_MAX_LEN];         // null-terminated file name
-    uint32_t start;                      // start offset in data region
-    uint32_t size;                       // file size in bytes
-    uint32_t perms;                      // file permissions
+    char     name[NAME_MAX_LEN];         // null-terminated name within its directory
+    uint32_t parent;                     // directory: its slot + 1, 0 = root
+    uint32_t start;                      // first overflow extent block (0 = none)
+    uint64_t size;                       // file size in bytes
+    uint32_t perms;                      // permissions; S_IFDIR for directories
     uint32_t mtime;                      // modification time
+    uint32_t nextents;                   // extents in use
+    uint8_t  flags;                      // FE_*
+    union {
+        Extent  extents[DIRECT_EXTENTS]; // sorted by lblk
+        uint8_t data[INLINE_MAX];        // FE_INLINE: the file's contents
+    };
 } FileEntry;
+
+#define FE_INLINE      0x01            // data is in FileEntry.data, no blocks
+
+// One link of a file's overflow extent chain, holding the extents past
+// the first DIRECT_EXTENTS (and past those of the links before it).
+typedef struct {
+    Extent   extents[OVERFLOW_EXTENTS];
+    uint32_t next;                       // next link, 0 = last
+} OverflowBlock;
+
+// Start of a compressed chunk in the image; the compressed bytes follow.
+typedef struct {
+    uint32_t clen;                       // compressed length
+    uint32_t checksum;                   // FNV-1a over those bytes
+} ChunkHeader;
+
+typedef struct {
+    uint32_t  magic;                     // JOURNAL_MAGIC
+    uint32_t  gen;                       // must match g_super.journal_gen
+    uint32_t  seq;                       // position in the journal
+    uint32_t  idx;                       // file table slot being updated
+    FileEntry entry;                     // new contents of that slot
+    uint32_t  checksum;                  // FNV-1a over the fields above
+} JournalRecord;
 #pragma pack(pop)
 
+// In memory the table is a structure of arrays. FileMeta has the fields
+// that scans, lookups and the data path read, naturally aligned and two
+// to a cache line; names and extent/inline bodies live in arrays of their
+// own and are only touched once a slot is known to be the right one.
+typedef struct {
+    uint64_t size;
+    uint32_t parent;
+    uint32_t perms;
+    uint32_t mtime;
+    uint32_t nextents;
+    uint32_t start;
+    uint8_t  used;
+    uint8_t  flags;
+    uint16_t tag;                        // name_tag() of parent and name
+} FileMeta;
+
+typedef union {
+    Extent  extents[DIRECT_EXTENTS];
+    uint8_t data[INLINE_MAX];
+} FileBody;
+
+static const char g_zero_block[BLOCK_SIZE];  // source for zero-fill
+
+// Mount options
+static struct options {
+    int use_mmap;                        // serve I/O from a shared mapping
+    int mkfs;                            // format a new image before mounting
+    char *size;                          // mkfs: initial volume size
+    char *max_size;                      // online growth limit
+    unsigned max_files;                  // mkfs: file table slots
+    char *cache_size;                    // block cache size (0 = off)
+    char *io_engine;                     // "sync" or "io_uring"
+    char *compress;                      // "lz4", "zstd" or "off"
+    int dedup;                           // share blocks with identical contents
+    double attr_timeout;                 // kernel attribute cache lifetime
+    double entry_timeout;                // kernel dentry cache lifetime
+    double negative_timeout;             // lifetime of cached ENOENT lookups
+    int no_writeback;                    // don't ask for FUSE_CAP_WRITEBACK_CACHE
+    char *max_write;                     // largest write request from the kernel
+    int no_readahead;                    // don't prefetch on sequential reads
+    int no_inline;                       // always give file data blocks
+    char *log_level;                     // off, error, warn, info or debug
+    char *log_file;                      // default stderr
+} g_opts;
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+#define VALUE(t, p)  { t, offsetof(struct options, p), 0 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("--mmap", use_mmap),
+    OPTION("mmap", use_mmap),
+    OPTION("mkfs", mkfs),
+    VALUE("size=%s", size),
+    VALUE("max_size=%s", max_size),
+    VALUE("max_files=%u", max_files),
+    VALUE("cache_size=%s", cache_size),
+    VALUE("io_engine=%s", io_engine),
+    VALUE("compress=%s", compress),
+    OPTION("dedup", dedup),
+    VALUE("attr_timeout=%lf", attr_timeout),
+    VALUE("entry_timeout=%lf", entry_timeout),
+    VALUE("negative_timeout=%lf", negative_timeout),
+    OPTION("no_writeback", no_writeback),
+    VALUE("max_write=%s", max_write),
+    OPTION("no_readahead", no_readahead),
+    OPTION("no_inline", no_inline),
+    VALUE("log_level=%s", log_level),
+    VALUE("log_file=%s", log_file),
+    FUSE_OPT_END
+};
+
 // Global state
-static FILE *g_fs_file = NULL;
+static int g_fs_fd = -1;
+static uint8_t *g_fs_map = NULL;         // MAP_SHARED view of the image (mmap mode)
+static uint64_t g_map_reserve = 0;       // address space reserved for g_fs_map
+static uint64_t g_dev_bytes = 0;         // current image size
 static Superblock g_super;
-static FileEntry  g_files[MAX_FILES];
+static FileMeta *g_meta = NULL;          // g_super.max_files entries each
+static char (*g_names)[NAME_MAX_LEN] = NULL;
+static FileBody *g_body = NULL;
+
+// Locking. Each slot's rwlock covers that file's data region and its
+// size/mtime as seen by readers. g_table_lock covers the superblock, name
+// lookup, slot allocation and the journal; any change to a slot is made
+// with both held, so holding either one gives a stable view of an entry.
+// Lock order is always slot lock first, then g_table_lock, then
+// g_journal_io.
+static pthread_rwlock_t *g_file_locks = NULL;
+static pthread_mutex_t  g_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// In-memory name -> slot index (open addressing, linear probing), guarded
+// by g_table_lock. Not persisted; rebuilt whenever the table is loaded.
+#define INDEX_EMPTY     (-1)
+#define INDEX_DELETED   (-2)
+static int32_t *g_name_index = NULL;
+static uint32_t g_index_size = 0;        // buckets; power of two >= 2 * max_files
+static uint32_t g_index_deleted = 0;     // tombstones currently in the index
+
+// Lock-free copies of what getattr needs, one cache line per slot (see
+// "Attribute snapshots" below). g_table_seq is odd while a name is being
+// added, removed or moved.
+typedef struct {
+    uint32_t seq;                        // odd while being rewritten
+    uint32_t used;
+    uint32_t parent;
+    uint32_t perms;
+    uint32_t mtime;
+    uint32_t tag;
+    uint64_t size;
+    uint64_t name[NAME_MAX_LEN / 8];
+} __attribute__((aligned(64))) EntrySnap;
+
+typedef struct {
+    uint32_t used;
+    uint32_t parent;
+    uint32_t perms;
+    uint32_t mtime;
+    uint64_t size;
+    char     name[NAME_MAX_LEN];
+} EntryAttr;
+
+static EntrySnap *g_snaps = NULL;        // g_super.max_files entries
+static uint32_t   g_table_seq = 0;
+
+// Every entry names its directory as that directory's slot + 1, so 0 is the
+// root, which has no slot of its own. Each directory also gets an
+// in-memory list of its children sorted by slot, rebuilt at load like the
+// name index. Guarded by g_table_lock.
+#define ROOT_DIR        0
+typedef struct {
+    uint32_t *child;                     // slots, ascending
+    uint32_t  count;
+    uint32_t  cap;
+} DirIndex;
+static DirIndex *g_dirs = NULL;          // g_super.max_files + 1, by directory
+
+static uint32_t g_journal_next = 0;      // next free record in the journal
+static uint32_t g_journal_claimed = 0;   // records before this one are being written
+static uint32_t g_journal_written = 0;   // records before this one are in the image
+static JournalRecord *g_journal_buf = NULL; // JOURNAL_RECORDS, as logged
+static JournalRecord *g_journal_out = NULL; // the committer's copy of a batch
+static int      g_journal_frees = 0;     // a record not yet written frees blocks
+// Held across every write to the journal area, taken after g_table_lock.
+// The committer keeps it, but not g_table_lock, while its batch is in flight.
+static pthread_mutex_t g_journal_io = PTHREAD_MUTEX_INITIALIZER;
+static int      g_blocks_freed = 0;      // blocks freed since the last record
+static pthread_cond_t g_journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_committer;
+static int      g_committer_running = 0;
+static time_t   g_last_checkpoint = 0;
+
+// Checkpoints only rewrite the parts of the table that changed.
+#define TABLE_CHUNK    64              // entries per dirty bit
+#define TABLE_BATCH    (16 * TABLE_CHUNK) // entries converted per table I/O
+static uint8_t *g_table_dirty = NULL;
+static FileEntry *g_table_buf = NULL;    // TABLE_BATCH on-disk records
+
+// The committer's checkpoint (see journal_checkpoint): a copy of the dirty
+// chunks, taken under g_table_lock and written with only g_journal_io held.
+static struct {
+    FileEntry  *buf;                     // TABLE_CHUNK entries per copied chunk
+    uint32_t   *chunks;                  // which chunks, ascending
+    uint32_t    nchunks;
+    uint32_t    cap;                     // chunks buf has room for
+    uint32_t    next;                    // journal records the copy covers
+    Superblock  super;                   // to write once the table is down
+    int         busy;                    // copied and not yet ended
+    int         failed;                  // the write or a flush failed
+    int         grew;                    // superblock write left to the end
+} g_ckpt;
 
 // Layout calculations
-#define META_SIZE      (sizeof(Superblock) + sizeof(FileEntry) * MAX_FILES)
-#define DATA_OFFSET    (META_SIZE)
-#define FILE_REGION_SIZE ((FS_SIZE - DATA_OFFSET) / MAX_FILES)
+#define META_SIZE      (sizeof(Superblock) + sizeof(FileEntry) * (uint64_t)g_super.max_files)
+#define JOURNAL_OFFSET (META_SIZE)
+#define JOURNAL_RECORDS (JOURNAL_SIZE / sizeof(JournalRecord))
+#define JOURNAL_CHECKPOINT_AT (JOURNAL_RECORDS / 2) // the committer checkpoints here
+#define CHUNK_MAP_OFFSET (JOURNAL_OFFSET + JOURNAL_SIZE)
+#define DATA_OFFSET    (CHUNK_MAP_OFFSET + g_super.map_chunks)
+#define MAX_FILE_SIZE  ((uint64_t)UINT32_MAX * BLOCK_SIZE)
+
+// A run of blocks for an I/O engine: cnt buffers at consecutive offsets
+// from off.
+typedef struct {
+    const struct iovec *iov;
+    int      cnt;
+    off_t    off;
+    int      write;
+} IoRun;
+
+typedef struct {
+    const char *name;
+    int (*setup)(void);                  // 0 or -errno; NULL if none needed
+    int (*submit)(const IoRun *runs, uint32_t n);  // 0 or -EIO
+} IoEngine;
+
+// Block cache (see "Block cache" below). g_cache_lock guards all of it.
+#define CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+#define CACHE_FLUSH_SECS   1             // max age of a dirty block, roughly
+#define CACHE_IOV_MAX      256           // blocks per run (IOV_MAX is 1024)
+#define CACHE_NONE         UINT32_MAX
+#define CACHE_IO_WRITE     1             // being written back
+#define CACHE_IO_FILL      2             // being read in; contents not there yet
+
+typedef struct {
+    uint32_t pblk;                       // 0 = unused (block 0 holds the superblock)
+    uint32_t next;                       // hash chain
+    uint32_t owner;                      // file slot, for per-file flushes
+    uint8_t  dirty;
+    uint8_t  ref;                        // CLOCK reference bit
+    uint8_t  io;                         // CACHE_IO_* in flight, or 0
+} CacheBlock;
+
+static CacheBlock *g_cache = NULL;
+static uint8_t   *g_cache_data = NULL;   // g_cache_size blocks
+static uint32_t  *g_cache_hash = NULL;   // chain heads
+static uint32_t  *g_cache_sort = NULL;   // scratch for write-back
+static struct iovec *g_cache_iov = NULL; // scratch for write-back
+static IoRun     *g_cache_runs = NULL;   // scratch for write-back
+static uint32_t   g_cache_size = 0;      // blocks; 0 = cache off
+static uint32_t   g_cache_hash_size = 0; // power of two
+static uint32_t   g_cache_hand = 0;      // CLOCK hand
+static uint32_t   g_cache_dirty = 0;
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_cache_cond = PTHREAD_COND_INITIALIZER;
+static int        g_cache_flushing = 0;  // a write-back batch is in flight
+static pthread_cond_t  g_cache_io_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t  g_flusher;
+static int        g_flusher_running = 0;
+
+// Compressed chunks (see "Compression" below). The image is divided into
+// chunks of CHUNK_BLOCKS; the map has one byte per chunk, CHUNK_RAW or the
+// algorithm and the number of blocks the compressed form takes. All of it
+// is guarded by g_cache_lock.
+#define CHUNK_BLOCKS   16                // 64 KB
+#define CHUNK_BYTES    (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_VIEWS    4                 // decompressed chunks kept for reads
+#define CHUNK_RAW      0
+#define CHUNK_LZ4      1
+#define CHUNK_ZSTD     2
+#define CHUNK_ALGO(m)  ((m) >> 4)
+#define CHUNK_LEN(m)   ((m) & 0x0F)      // in blocks
+
+static uint8_t  *g_chunk_map = NULL;     // g_super.map_chunks entries
+static uint8_t  *g_chunk_pins = NULL;    // overflow extent blocks per chunk
+static uint8_t  *g_map_dirty = NULL;     // one bit per block of the map
+static int       g_map_changed = 0;
+static int       g_compress = CHUNK_RAW; // algorithm for chunks written now
+static int       g_chunked = 0;          // data I/O goes through the chunk layer
+static int       g_chunk_punch = 1;      // cleared if the host cannot punch holes
+static uint8_t  *g_chunk_buf = NULL;     // CHUNK_BYTES being written back
+static uint8_t  *g_chunk_zbuf = NULL;    // CHUNK_BYTES of compressed chunk
+static struct {
+    uint32_t chunk;                      // UINT32_MAX = empty
+    uint8_t *data;                       // CHUNK_BYTES
+} g_chunk_views[CHUNK_VIEWS];
+static uint32_t  g_chunk_view_next = 0;
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *g_zstd_cctx = NULL;
+static ZSTD_DCtx *g_zstd_dctx = NULL;
+#endif
+
+// Deduplication (see "Deduplication" below). g_block_refs holds, per
+// block, how many more extents map it beyond the first and whether the
+// index lists it. The index is a set-associative hash -> block table.
+// Both are guarded by g_table_lock.
+#define REF_SHARES     0x7F              // extra references, up to 127
+#define REF_HASHED     0x80              // contents are in the index
+#define DEDUP_WAYS     4
+#define DEDUP_MAX_SETS (1u << 18)        // 16 MB of index at most
+typedef struct {
+    uint64_t hash;
+    uint32_t pblk;                       // 0 = empty
+    uint32_t pad;
+} DedupEntry;
+static DedupEntry *g_dedup_index = NULL; // g_dedup_sets * DEDUP_WAYS
+static uint32_t    g_dedup_sets = 0;     // power of two; 0 = dedup off
+
+// Open files and readahead (see "Open files and readahead" below)
+#define RA_MIN_BLOCKS  8                 // first window: 32 KB
+#define RA_MAX_BLOCKS  256               // largest window: 1 MB
+#define RA_QUEUE       64                // pending prefetches; more are dropped
+#define HANDLE_SLAB    256               // handles carved out per allocation
+
+typedef struct FileHandle {
+    uint32_t idx;                        // file table slot
+    uint32_t ext_cursor;                 // extent the last read ended in (__atomic)
+    pthread_mutex_t lock;                // guards the readahead state below
+    uint64_t next_off;                   // where a sequential read continues
+    uint32_t ra_window;                  // blocks to keep ahead; 0 = random
+    uint32_t ra_next;                    // first block not yet asked for
+    char    *snap;                       // /.stats contents, for STATS_FILE
+    size_t   snap_len;
+    struct FileHandle *next_free;        // pool free list
+} FileHandle;
+
+typedef struct HandleSlab {
+    struct HandleSlab *next;
+    FileHandle handles[HANDLE_SLAB];
+} HandleSlab;
+
+static HandleSlab *g_handle_slabs = NULL;
+static FileHandle *g_handle_free = NULL;
+static pthread_mutex_t g_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    uint32_t idx;
+    uint32_t lblk;
+    uint32_t count;
+} RaRequest;
+
+static RaRequest  g_ra_queue[RA_QUEUE];
+static uint32_t   g_ra_slots[RA_MAX_BLOCKS];     // the worker's own scratch
+static struct iovec g_ra_iov[RA_MAX_BLOCKS];
+static IoRun      g_ra_runs[RA_MAX_BLOCKS];
+static uint32_t   g_ra_head = 0, g_ra_tail = 0;
+static pthread_mutex_t g_ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t  g_ra_worker;
+static int        g_ra_running = 0;
+
+// Logging (see "Logging" below)
+enum { LOG_OFF, LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+#define LOG_SLOTS      1024              // ring entries
+#define LOG_RATE       1000              // records per second before dropping
+#define LOG_DRAIN_MS   100
+
+typedef struct {
+    uint32_t seq;                        // ring protocol, see log_emit
+    uint8_t  level;
+    struct timespec ts;
+    char     msg[116];
+} LogRecord;
+
+static LogRecord  g_log_ring[LOG_SLOTS];
+static uint32_t   g_log_tail = 0;        // next slot to claim (producers)
+static uint32_t   g_log_head = 0;        // next slot to drain (drainer only)
+static uint64_t   g_log_dropped = 0;
+static time_t     g_log_window = 0;      // second g_log_budget counts for
+static uint32_t   g_log_budget = 0;
+static int        g_log_level = LOG_OFF; // set once in main
+static FILE      *g_log_out = NULL;
+static pthread_t  g_log_thread;
+static int        g_log_running = 0;
+
+// Per-callback statistics (see "Statistics" below)
+#define STATS_PATH     "/.stats"         // virtual read-only file in the root
+#define STATS_FILE     (UINT32_MAX - 1)  // FileHandle.idx of an open /.stats
+#define STATS_SHARDS   32
+#define STATS_SUB_BITS 3                 // 8 buckets per power of two
+#define STATS_MAX_BITS 40                // ~18 minutes in ns; longer is clamped
+#define STATS_BUCKETS  ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+enum { OP_GETATTR, OP_READDIR, OP_OPEN, OP_CREATE, OP_READ, OP_WRITE,
+       OP_UNLINK, OP_TRUNCATE, OP_FSYNC, OP_COUNT };
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STATS_BUCKETS];
+} OpStats;
+
+typedef struct {
+    OpStats  op[OP_COUNT];
+    uint64_t cache_hits;                 // blocks read from the block cache
+    uint64_t cache_misses;               // blocks read from the image instead
+    uint64_t ra_blocks;                  // blocks prefetched by readahead
+    uint64_t chunk_in;                   // bytes of chunks written back
+    uint64_t chunk_out;                  // bytes that took in the image
+    uint64_t dedup_blocks;               // block writes that shared a block instead
+    uint64_t cow_blocks;                 // shared blocks copied before a write
+} __attribute__((aligned(64))) StatShard;
+
+static StatShard g_stats[STATS_SHARDS];
+
+// Allocator state (see "Block allocator" below)
+static uint8_t  *g_block_bitmap = NULL;  // covers g_super.block_count blocks
+static uint32_t  g_free_blocks = 0;      // stored with __atomic, read by statfs
+static uint8_t  *g_block_refs = NULL;    // g_super.max_blocks entries, or NULL
+static struct overflow {                 // cached overflow extent chains
+    uint32_t  nblocks;                   // links in the chain
+    uint32_t *blocks;                    // their block numbers, in order
+    Extent   *extents;                   // nblocks * OVERFLOW_EXTENTS
+} *g_overflow = NULL;
+static uint64_t *g_slot_bitmap = NULL;   // file table slots in use, 64 per word
+static uint32_t  g_slot_hint = 0;        // every slot below this one is in use
+static uint32_t  g_table_high = 0;       // every slot at or above this one is free
+static uint32_t  g_used_slots = 0;       // stored with __atomic, read by statfs
 
 // ---------- Utility ----------
 
@@ -54,407 +528,5330 @@ static void fatal(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-static void fs_recompute_last_alloc(void) {
-    uint32_t last = DATA_OFFSET;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (g_files[i].used && g_files[i].size > 0) {
-            uint32_t region_start = DATA_OFFSET + i * FILE_REGION_SIZE;
-            uint32_t end = region_start + g_files[i].size;
-            if (end > last) {
-                last = end;
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (!p) {
+        fatal("Out of memory");
+    }
+    return p;
+}
+
+// Parse a size like "512K", "64M" or "10G". Returns 0 if it is malformed.
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'T': case 't': v <<= 10; // fall through
+    case 'G': case 'g': v <<= 10; // fall through
+    case 'M': case 'm': v <<= 10; // fall through
+    case 'K': case 'k': v <<= 10; end++; break;
+    case '\0': break;
+    default: return 0;
+    }
+    return *end == '\0' ? v : 0;
+}
+
+static uint32_t fs_checksum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// ---------- Logging ----------
+//
+// Off unless -o log_level= asks for it, and then cheap on the request path:
+// fs_log only formats when the level is enabled, and the record goes into
+// a lock-free ring (a bounded MPMC queue in the style of Vyukov's, with one
+// consumer) that a background thread drains to stderr or -o log_file=.
+// Past LOG_RATE records a second, or when the ring is full, records are
+// counted instead and the drainer reports how many were lost.
+
+static int log_enabled(int level) {
+    return level <= g_log_level;
+}
+
+#define fs_log(level, ...) do { \
+        if (log_enabled(level)) log_emit(level, __VA_ARGS__); \
+    } while (0)
+
+static const char *const g_log_names[] = { "off", "error", "warn", "info", "debug" };
+
+static void log_setup(void) {
+    if (g_opts.log_level) {
+        for (int l = LOG_OFF; l <= LOG_DEBUG; l++) {
+            if (strcmp(g_opts.log_level, g_log_names[l]) == 0) {
+                g_log_level = l;
             }
         }
+        if (g_log_level == LOG_OFF && strcmp(g_opts.log_level, "off") != 0) {
+            fatal("Unknown log_level= (use off, error, warn, info or debug)");
+        }
+    }
+    if (g_log_level == LOG_OFF) return;
+
+    for (uint32_t i = 0; i < LOG_SLOTS; i++) {
+        g_log_ring[i].seq = i;
+    }
+    // Opened before libfuse daemonizes and changes to /.
+    g_log_out = stderr;
+    if (g_opts.log_file && (g_log_out = fopen(g_opts.log_file, "a")) == NULL) {
+        fatal("Cannot open log_file=");
     }
-    g_super.last_alloc = last;
 }
 
-static void fs_sync_metadata(void) {
-    if (!g_fs_file) return;
+__attribute__((format(printf, 2, 3)))
+static void log_emit(int level, const char *fmt, ...) {
+    // Crude per-second budget; the window reset may race, which only
+    // lets a few extra records through.
+    time_t now = time(NULL);
+    time_t window = __atomic_load_n(&g_log_window, __ATOMIC_RELAXED);
+    if (window != now &&
+        __atomic_compare_exchange_n(&g_log_window, &window, now, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&g_log_budget, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&g_log_budget, 1, __ATOMIC_RELAXED) >= LOG_RATE) {
+        __atomic_fetch_add(&g_log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
 
-    rewind(g_fs_file);
-    if (fwrite(&g_super, sizeof(g_super), 1, g_fs_file) != 1) {
-        fatal("Failed to write superblock");
+    // Claim the slot at the tail once the drainer has released it.
+    LogRecord *r;
+    uint32_t pos = __atomic_load_n(&g_log_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        r = &g_log_ring[pos % LOG_SLOTS];
+        int32_t diff = (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_log_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&g_log_dropped, 1, __ATOMIC_RELAXED);
+            return;  // full
+        } else {
+            pos = __atomic_load_n(&g_log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    r->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Write out every published record. Only the drainer calls this.
+static void log_drain(void) {
+    for (;;) {
+        LogRecord *r = &g_log_ring[g_log_head % LOG_SLOTS];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != g_log_head + 1) {
+            break;
+        }
+        struct tm tm;
+        char when[32];
+        localtime_r(&r->ts.tv_sec, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        fprintf(g_log_out, "%s.%03ld %s %s\n", when, r->ts.tv_nsec / 1000000,
+                g_log_names[r->level], r->msg);
+        __atomic_store_n(&r->seq, g_log_head + LOG_SLOTS, __ATOMIC_RELEASE);
+        g_log_head++;
     }
-    if (fwrite(g_files, sizeof(g_files), 1, g_fs_file) != 1) {
-        fatal("Failed to write file table");
+    uint64_t lost = __atomic_exchange_n(&g_log_dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        fprintf(g_log_out, "log: %llu records dropped\n", (unsigned long long)lost);
     }
-    fflush(g_fs_file);
+    fflush(g_log_out);
 }
 
-static void fs_load_metadata(void) {
-    rewind(g_fs_file);
-    if (fread(&g_super, sizeof(g_super), 1, g_fs_file) != 1) {
-        fatal("Failed to read superblock");
+static void *log_drainer(void *arg) {
+    (void) arg;
+    struct timespec ts = { 0, LOG_DRAIN_MS * 1000000L };
+    while (__atomic_load_n(&g_log_running, __ATOMIC_ACQUIRE)) {
+        log_drain();
+        nanosleep(&ts, NULL);
+    }
+    log_drain();
+    return NULL;
+}
+
+// Started from my_init like the other threads; stopped last in destroy so
+// that nothing logged during unmount is lost.
+static void log_start(void) {
+    if (g_log_level == LOG_OFF) return;
+
+    g_log_running = 1;
+    if (pthread_create(&g_log_thread, NULL, log_drainer, NULL) != 0) {
+        fatal("Failed to start log drainer");
     }
-    if (fread(g_files, sizeof(g_files), 1, g_fs_file) != 1) {
-        fatal("Failed to read file table");
+}
+
+static void log_stop(void) {
+    if (!g_log_running) return;
+
+    __atomic_store_n(&g_log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(g_log_thread, NULL);
+    if (g_log_out != stderr) {
+        fclose(g_log_out);
     }
 }
 
-static void fs_format(void) {
-    // Create or overwrite the backing file with fixed size
-    g_fs_file = fopen(FS_FILENAME, "w+b");
-    if (!g_fs_file) {
-        fatal("Failed to create filesystem file");
+// ---------- Statistics ----------
+//
+// Callers count into one of STATS_SHARDS shards, picked per thread on
+// first use, so threads don't share cache lines on the hot path. Relaxed
+// atomics make it safe when there are more threads than shards. Latency
+// goes into an HDR-style histogram: exact below 8 ns, and 8 sub-buckets per
+// power of two above that, so every bucket is within 12.5% of its values.
+// A read of /.stats sums the shards into a text snapshot.
+
+static __thread uint32_t t_stats_shard = UINT32_MAX;
+static uint32_t g_stats_next = 0;
+
+static StatShard *stats_shard(void) {
+    if (t_stats_shard == UINT32_MAX) {
+        t_stats_shard = __atomic_fetch_add(&g_stats_next, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
     }
+    return &g_stats[t_stats_shard];
+}
+
+static uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
 
-    // Expand file to FS_SIZE bytes
-    if (fseek(g_fs_file, FS_SIZE - 1, SEEK_SET) != 0) {
-        fatal("fseek failed when sizing filesystem file");
+static uint32_t stats_bucket(uint64_t ns) {
+    const uint32_t sub = 1u << STATS_SUB_BITS;
+    if (ns < sub) {
+        return ns;
     }
-    if (fputc('\0', g_fs_file) == EOF) {
-        fatal("fputc failed when sizing filesystem file");
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= STATS_MAX_BITS) {
+        return STATS_BUCKETS - 1;
     }
-    fflush(g_fs_file);
+    int shift = msb - STATS_SUB_BITS;
+    return ((shift + 1) << STATS_SUB_BITS) | ((ns >> shift) & (sub - 1));
+}
 
-    // Initialize metadata
-    memset(&g_super, 0, sizeof(g_super));
-    memset(g_files, 0, sizeof(g_files));
+// Largest value that lands in bucket b.
+static uint64_t stats_bucket_max(uint32_t b) {
+    const uint32_t sub = 1u << STATS_SUB_BITS;
+    if (b < sub) {
+        return b;
+    }
+    int shift = (b >> STATS_SUB_BITS) - 1;
+    uint64_t mant = (b & (sub - 1)) | sub;
+    return ((mant + 1) << shift) - 1;
+}
 
-    g_super.magic      = FS_MAGIC;
-    g_super.version    = FS_VERSION;
-    g_super.last_alloc = DATA_OFFSET;  // nothing used except metadata
-    g_super.file_count = 0;
+static void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
 
-    fs_sync_metadata();
+// Account one call of op that started at t0 and returned ret, having
+// moved bytes of data.
+static void stats_record(int op, uint64_t t0, int ret, uint64_t bytes) {
+    uint64_t ns = stats_now() - t0;
+    OpStats *s = &stats_shard()->op[op];
+    stats_add(&s->calls, 1);
+    stats_add(&s->errors, ret < 0);
+    stats_add(&s->bytes, bytes);
+    stats_add(&s->total_ns, ns);
+    stats_add(&s->hist[stats_bucket(ns)], 1);
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
 }
 
-static void fs_init(void) {
-    g_fs_file = fopen(FS_FILENAME, "r+b");
-    if (!g_fs_file) {
-        // File does not exist -> format new filesystem
-        printf("Filesystem not found. Creating new filesystem...\n");
-        fs_format();
-        return;
+static uint64_t stats_sum(const uint64_t *first) {
+    // first points into g_stats[0]; the same field sits one shard apart.
+    uint64_t v = 0;
+    for (uint32_t i = 0; i < STATS_SHARDS; i++) {
+        v += __atomic_load_n((const uint64_t *)((const char *)first + i * sizeof(StatShard)),
+                             __ATOMIC_RELAXED);
     }
+    return v;
+}
 
-    // Check size
-    if (fseek(g_fs_file, 0, SEEK_END) != 0) {
-        fatal("fseek failed");
+// Bucket bounds can overshoot the largest value seen; max caps them.
+static uint64_t stats_percentile(const uint64_t *hist, uint64_t total, double q,
+                                 uint64_t max) {
+    uint64_t rank = (uint64_t)(q * total + 0.999999), seen = 0;
+    for (uint32_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t v = stats_bucket_max(b);
+            return v < max ? v : max;
+        }
     }
-    long size = ftell(g_fs_file);
-    if (size != FS_SIZE) {
-        printf("Filesystem file has wrong size. Reformatting...\n");
-        fclose(g_fs_file);
-        fs_format();
-        return;
+    return 0;
+}
+
+// Render the merged counters into a malloc'd buffer. Returns its length,
+// or -ENOMEM.
+static int stats_render(char **out) {
+    static const char *const names[OP_COUNT] = {
+        "getattr", "readdir", "open", "create", "read", "write",
+        "unlink", "truncate", "fsync",
+    };
+    size_t cap = 384 + OP_COUNT * 160, len = 0;
+    char *buf = malloc(cap);
+    uint64_t *hist = malloc(STATS_BUCKETS * sizeof(uint64_t));
+    if (buf == NULL || hist == NULL) {
+        free(buf);
+        free(hist);
+        return -ENOMEM;
     }
 
-    // Load metadata
-    fs_load_metadata();
+    len += snprintf(buf + len, cap - len,
+                    "# op calls errors bytes avg_us p50_us p90_us p99_us p999_us max_us\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const OpStats *s = &g_stats[0].op[op];
+        uint64_t calls = stats_sum(&s->calls);
+        uint64_t max = 0;
+        for (uint32_t i = 0; i < STATS_SHARDS; i++) {
+            uint64_t m = __atomic_load_n(&g_stats[i].op[op].max_ns, __ATOMIC_RELAXED);
+            max = m > max ? m : max;
+        }
+        // Counts keep moving while we read; use what the buckets add up to.
+        uint64_t total = 0;
+        for (uint32_t b = 0; b < STATS_BUCKETS; b++) {
+            hist[b] = stats_sum(&s->hist[b]);
+            total += hist[b];
+        }
+        len += snprintf(buf + len, cap - len,
+                        "%s %llu %llu %llu %.1f %.1f %.1f %.1f %.1f %.1f\n", names[op],
+                        (unsigned long long)calls,
+                        (unsigned long long)stats_sum(&s->errors),
+                        (unsigned long long)stats_sum(&s->bytes),
+                        calls ? stats_sum(&s->total_ns) / 1e3 / calls : 0.0,
+                        stats_percentile(hist, total, 0.50, max) / 1e3,
+                        stats_percentile(hist, total, 0.90, max) / 1e3,
+                        stats_percentile(hist, total, 0.99, max) / 1e3,
+                        stats_percentile(hist, total, 0.999, max) / 1e3,
+                        max / 1e3);
+    }
+    len += snprintf(buf + len, cap - len, "cache_hits %llu\ncache_misses %llu\nreadahead_blocks %llu\n"
+                    "chunk_bytes_in %llu\nchunk_bytes_out %llu\n"
+                    "dedup_blocks %llu\ncow_blocks %llu\n",
+                    (unsigned long long)stats_sum(&g_stats[0].cache_hits),
+                    (unsigned long long)stats_sum(&g_stats[0].cache_misses),
+                    (unsigned long long)stats_sum(&g_stats[0].ra_blocks),
+                    (unsigned long long)stats_sum(&g_stats[0].chunk_in),
+                    (unsigned long long)stats_sum(&g_stats[0].chunk_out),
+                    (unsigned long long)stats_sum(&g_stats[0].dedup_blocks),
+                    (unsigned long long)stats_sum(&g_stats[0].cow_blocks));
+    free(hist);
+    *out = buf;
+    return (int)len;
+}
 
-    if (g_super.magic != FS_MAGIC) {
-        printf("Filesystem magic mismatch. Reformatting...\n");
-        fclose(g_fs_file);
-        fs_format();
+// ---------- Name index ----------
+
+static uint32_t name_hash(uint32_t dir, const char *name, size_t len) {
+    return fs_checksum(name, len) ^ (dir * 2654435761u);
+}
+
+// The bucket comes from the low bits of the hash; the top 16 are kept next
+// to each entry, so probes can skip most other names in the same run
+// without reading them.
+static uint16_t name_tag(uint32_t hash) {
+    return (uint16_t)(hash >> 16);
+}
+
+// Names are stored NUL-padded to NAME_MAX_LEN, so two are equal exactly
+// when the whole fields are. Lookups pad the probe once and compare with
+// the widest vector unit available; name_eq_init picks it at startup.
+static int name_eq_scalar(const void *a, const void *b) {
+    uint64_t x[NAME_MAX_LEN / 8], y[NAME_MAX_LEN / 8];
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    uint64_t diff = 0;
+    for (int i = 0; i < NAME_MAX_LEN / 8; i++) {
+        diff |= x[i] ^ y[i];
+    }
+    return diff == 0;
+}
+
+#if defined(__x86_64__)
+static int name_eq_sse2(const void *a, const void *b) {
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+                                _mm_loadu_si128((const __m128i *)b));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a + 1),
+                                _mm_loadu_si128((const __m128i *)b + 1));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static int name_eq_avx2(const void *a, const void *b) {
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)a),
+                                   _mm256_loadu_si256((const __m256i *)b));
+    return _mm256_movemask_epi8(eq) == -1;
+}
+#elif defined(__aarch64__)
+static int name_eq_neon(const void *a, const void *b) {
+    const uint8_t *x = a, *y = b;
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(x), vld1q_u8(y)),
+                             vceqq_u8(vld1q_u8(x + 16), vld1q_u8(y + 16)));
+    return vminvq_u8(eq) == 0xFF;
+}
+#endif
+
+static int (*name_eq)(const void *a, const void *b) = name_eq_scalar;
+
+static void name_eq_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    name_eq = __builtin_cpu_supports("avx2") ? name_eq_avx2 : name_eq_sse2;
+#elif defined(__aarch64__)
+    name_eq = name_eq_neon;
+#endif
+}
+
+// Lookup key: the name NUL-padded as stored, and its hash.
+typedef struct {
+    char     name[NAME_MAX_LEN];
+    uint32_t hash;
+} NameKey;
+
+// Returns -1 if the name can't be stored.
+static int name_key(NameKey *k, uint32_t dir, const char *name, size_t len) {
+    if (len >= NAME_MAX_LEN) {
+        return -1;
+    }
+    memset(k->name, 0, sizeof(k->name));
+    memcpy(k->name, name, len);
+    k->hash = name_hash(dir, name, len);
+    return 0;
+}
+
+static uint32_t entry_hash(int idx) {
+    return name_hash(g_meta[idx].parent, g_names[idx],
+                     strnlen(g_names[idx], NAME_MAX_LEN));
+}
+
+static void name_index_rebuild(void);
+
+// Caller has already marked the entry used.
+static void name_index_insert(int idx) {
+    // Misses only stop at an empty bucket, so don't let tombstones pile up.
+    // The rebuild picks up idx along with every other used entry.
+    if (g_index_deleted > g_index_size / 4) {
+        name_index_rebuild();
         return;
     }
+
+    uint32_t hash = entry_hash(idx);
+    g_meta[idx].tag = name_tag(hash);
+    uint32_t h = hash & (g_index_size - 1);
+    while (g_name_index[h] >= 0) {
+        h = (h + 1) & (g_index_size - 1);
+    }
+    if (g_name_index[h] == INDEX_DELETED) {
+        g_index_deleted--;
+    }
+    __atomic_store_n(&g_name_index[h], idx, __ATOMIC_RELEASE);
 }
 
-// ---------- File table helpers ----------
+static void name_index_rebuild(void) {
+    for (uint32_t i = 0; i < g_index_size; i++) {
+        __atomic_store_n(&g_name_index[i], INDEX_EMPTY, __ATOMIC_RELEASE);
+    }
+    g_index_deleted = 0;
+    for (uint32_t i = 0; i < g_table_high; i++) {
+        if (g_meta[i].used) {
+            name_index_insert(i);
+        }
+    }
+}
 
-static int find_file_by_name(const char *name) {
-    // Skip leading '/'
-    if (name[0] == '/') {
-        name++;
+// Returns the slot holding the len-byte name in dir, or -1.
+static int name_index_lookup(uint32_t dir, const char *name, size_t len) {
+    NameKey k;
+    if (name_key(&k, dir, name, len) < 0) {
+        return -1;
     }
-    
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (g_files[i].used && strncmp(g_files[i].name, name, NAME_MAX_LEN) == 0) {
-            return i;
+    uint16_t tag = name_tag(k.hash);
+    uint32_t h = k.hash & (g_index_size - 1);
+    for (uint32_t n = 0; n < g_index_size && g_name_index[h] != INDEX_EMPTY; n++) {
+        int idx = g_name_index[h];
+        if (idx >= 0 && g_meta[idx].tag == tag && g_meta[idx].parent == dir &&
+            name_eq(g_names[idx], k.name)) {
+            return idx;
         }
+        h = (h + 1) & (g_index_size - 1);
     }
     return -1;
 }
 
-static int alloc_file_slot(void) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!g_files[i].used) {
-            return i;
+// Call before the entry's name or parent changes.
+static void name_index_remove(int idx) {
+    uint32_t h = entry_hash(idx) & (g_index_size - 1);
+    for (uint32_t n = 0; n < g_index_size && g_name_index[h] != INDEX_EMPTY; n++) {
+        if (g_name_index[h] == idx) {
+            __atomic_store_n(&g_name_index[h], INDEX_DELETED, __ATOMIC_RELEASE);
+            g_index_deleted++;
+            break;
         }
+        h = (h + 1) & (g_index_size - 1);
     }
-    return -1; // no space
 }
 
-// ---------- FUSE Callbacks ----------
+// ---------- Directory index ----------
 
-static int my_getattr(const char *path, struct stat *stbuf,
-                      struct fuse_file_info *fi) {
-    (void) fi;
-    
-    memset(stbuf, 0, sizeof(struct stat));
+static int is_dir(int idx) {
+    return S_ISDIR(g_meta[idx].perms);
+}
 
-    // Root directory
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        return 0;
+// First position in d whose slot is >= idx.
+static uint32_t dir_index_find(const DirIndex *d, uint32_t idx) {
+    uint32_t lo = 0, hi = d->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (d->child[mid] < idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void dir_index_insert(uint32_t dir, uint32_t idx) {
+    DirIndex *d = &g_dirs[dir];
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->child = realloc(d->child, d->cap * sizeof(uint32_t));
+        if (!d->child) {
+            fatal("Out of memory");
+        }
+    }
+    uint32_t pos = dir_index_find(d, idx);
+    memmove(&d->child[pos + 1], &d->child[pos], (d->count - pos) * sizeof(uint32_t));
+    d->child[pos] = idx;
+    d->count++;
+}
+
+static void dir_index_remove(uint32_t dir, uint32_t idx) {
+    DirIndex *d = &g_dirs[dir];
+    uint32_t pos = dir_index_find(d, idx);
+    if (pos < d->count && d->child[pos] == idx) {
+        d->count--;
+        memmove(&d->child[pos], &d->child[pos + 1], (d->count - pos) * sizeof(uint32_t));
+    }
+}
+
+// Run before name_index_rebuild: entries whose directory is gone are moved
+// to the root (in memory only), so they stay reachable.
+static void dir_index_rebuild(void) {
+    for (uint32_t i = 0; i <= g_table_high; i++) {
+        g_dirs[i].count = 0;
+    }
+    for (uint32_t i = 0; i < g_table_high; i++) {
+        if (!g_meta[i].used) {
+            continue;
+        }
+        uint32_t dir = g_meta[i].parent;
+        if (dir > g_super.max_files || dir == i + 1 ||
+            (dir != ROOT_DIR && (!g_meta[dir - 1].used || !is_dir(dir - 1)))) {
+            fprintf(stderr, "'%s' lost its directory; moved to /\n", g_names[i]);
+            g_meta[i].parent = dir = ROOT_DIR;
+        }
+        dir_index_insert(dir, i);  // ascending, so this never shifts
+    }
+}
+
+// Resolve every component of path but the last. On success *dir is the
+// directory the last component lives in and *leaf points at that
+// component ("" for the root). Caller holds g_table_lock.
+static int path_parent(const char *path, uint32_t *dir, const char **leaf) {
+    uint32_t d = ROOT_DIR;
+    const char *p = path;
+    if (*p == '/') {
+        p++;
+    }
+
+    const char *slash;
+    while ((slash = strchr(p, '/')) != NULL) {
+        int idx = name_index_lookup(d, p, slash - p);
+        if (idx < 0) {
+            return -ENOENT;
+        }
+        if (!is_dir(idx)) {
+            return -ENOTDIR;
+        }
+        d = idx + 1;
+        p = slash + 1;
+    }
+
+    if (strlen(p) >= NAME_MAX_LEN) {
+        return -ENAMETOOLONG;
+    }
+    *dir = d;
+    *leaf = p;
+    return 0;
+}
+
+// ---------- Attribute snapshots ----------
+//
+// getattr runs far more often than anything else (build systems stat
+// every file they know about), so it doesn't take g_table_lock. Each slot
+// has an EntrySnap that fs_journal_log republishes after every change to
+// the entry, under a per-slot sequence count; the name index is updated
+// with atomic stores, in place. A lookup walks the path through those,
+// and is thrown away and retried if a slot it read was being rewritten or
+// g_table_seq moved (a name was added, removed or renamed meanwhile).
+// Only writers store to either, so readers never dirty a shared line.
+// After a few failed tries the reader takes the lock after all.
+
+#define SNAP_TRIES     4
+
+// Writers bracket name changes with these. Caller holds g_table_lock.
+// Everything stored in between is a release store, so it can't become
+// visible before the odd count; readers load it with acquire for the same
+// reason. That keeps the protocol free of standalone fences.
+static void table_seq_begin(void) {
+    __atomic_store_n(&g_table_seq, g_table_seq + 1, __ATOMIC_RELAXED);
+}
+
+static void table_seq_end(void) {
+    __atomic_store_n(&g_table_seq, g_table_seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copy slot idx to its snapshot. Caller holds g_table_lock.
+static void snap_publish(int idx) {
+    EntrySnap *sn = &g_snaps[idx];
+    const FileMeta *fm = &g_meta[idx];
+    uint64_t name[NAME_MAX_LEN / 8];
+    memcpy(name, g_names[idx], sizeof(name));
+
+    __atomic_store_n(&sn->seq, sn->seq + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sn->used, fm->used, __ATOMIC_RELEASE);
+    __atomic_store_n(&sn->parent, fm->parent, __ATOMIC_RELEASE);
+    __atomic_store_n(&sn->perms, fm->perms, __ATOMIC_RELEASE);
+    __atomic_store_n(&sn->mtime, fm->mtime, __ATOMIC_RELEASE);
+    __atomic_store_n(&sn->tag, fm->tag, __ATOMIC_RELEASE);
+    __atomic_store_n(&sn->size, fm->size, __ATOMIC_RELEASE);
+    for (int i = 0; i < NAME_MAX_LEN / 8; i++) {
+        __atomic_store_n(&sn->name[i], name[i], __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&sn->seq, sn->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void snap_publish_all(void) {
+    for (uint32_t i = 0; i < g_table_high; i++) {
+        snap_publish(i);
+    }
+}
+
+// Read slot idx's snapshot. Returns 0, or -EAGAIN if it changed meanwhile.
+static int snap_read(uint32_t idx, EntryAttr *a) {
+    EntrySnap *sn = &g_snaps[idx];
+    uint64_t name[NAME_MAX_LEN / 8];
+
+    uint32_t seq = __atomic_load_n(&sn->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -EAGAIN;
+    }
+    a->used   = __atomic_load_n(&sn->used, __ATOMIC_ACQUIRE);
+    a->parent = __atomic_load_n(&sn->parent, __ATOMIC_ACQUIRE);
+    a->perms  = __atomic_load_n(&sn->perms, __ATOMIC_ACQUIRE);
+    a->mtime  = __atomic_load_n(&sn->mtime, __ATOMIC_ACQUIRE);
+    a->size   = __atomic_load_n(&sn->size, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < NAME_MAX_LEN / 8; i++) {
+        name[i] = __atomic_load_n(&sn->name[i], __ATOMIC_ACQUIRE);
+    }
+    if (__atomic_load_n(&sn->seq, __ATOMIC_RELAXED) != seq) {
+        return -EAGAIN;
+    }
+    memcpy(a->name, name, sizeof(name));
+    a->name[NAME_MAX_LEN - 1] = '\0';
+    return 0;
+}
+
+// name_index_lookup over the snapshots: the slot, -1 if there is none,
+// or -EAGAIN.
+// Tags and parents only change while g_table_seq is odd, so a candidate
+// can be rejected on those alone; snap_find notices if that raced.
+static int snap_lookup(uint32_t dir, const char *name, size_t len, EntryAttr *a) {
+    NameKey k;
+    if (name_key(&k, dir, name, len) < 0) {
+        return -1;
+    }
+    uint32_t tag = name_tag(k.hash);
+    uint32_t h = k.hash & (g_index_size - 1);
+    for (uint32_t n = 0; n < g_index_size; n++) {
+        int32_t idx = __atomic_load_n(&g_name_index[h], __ATOMIC_ACQUIRE);
+        if (idx == INDEX_EMPTY) {
+            break;
+        }
+        if (idx >= 0 && (uint32_t)idx < g_super.max_files &&
+            __atomic_load_n(&g_snaps[idx].tag, __ATOMIC_ACQUIRE) == tag &&
+            __atomic_load_n(&g_snaps[idx].parent, __ATOMIC_ACQUIRE) == dir) {
+            if (snap_read(idx, a) < 0) {
+                return -EAGAIN;
+            }
+            if (a->used && a->parent == dir && name_eq(a->name, k.name)) {
+                return idx;
+            }
+        }
+        h = (h + 1) & (g_index_size - 1);
+    }
+    return -1;
+}
+
+// find_file_by_name without g_table_lock. Fills *a and returns the slot,
+// returns -1 if there is no such entry, or -EAGAIN if the lookup raced
+// with a change and the caller should fall back to the lock.
+static int snap_find(const char *path, EntryAttr *a) {
+    for (int tries = 0; tries < SNAP_TRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&g_table_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        uint32_t d = ROOT_DIR;
+        const char *p = path + (*path == '/');
+        int idx;
+        for (;;) {
+            const char *slash = strchr(p, '/');
+            size_t len = slash ? (size_t)(slash - p) : strlen(p);
+            idx = snap_lookup(d, p, len, a);
+            if (idx < 0 || slash == NULL) {
+                break;
+            }
+            if (!S_ISDIR(a->perms)) {
+                idx = -1;
+                break;
+            }
+            d = idx + 1;
+            p = slash + 1;
+        }
+
+        if (idx != -EAGAIN && __atomic_load_n(&g_table_seq, __ATOMIC_RELAXED) == seq) {
+            return idx;
+        }
+    }
+    return -EAGAIN;
+}
+
+// ---------- Backing store ----------
+//
+// All access to filesys.db goes through these helpers. By default they use
+// positional pread/pwrite, so concurrent requests never share a seek
+// pointer; with -o mmap the image is mapped MAP_SHARED and requests are
+// plain memcpy into and out of the mapping, with msync only on fsync and
+// at unmount.
+
+// The mapping sits at the start of a large PROT_NONE reservation, so the
+// image can grow by mapping more of the file in place, without moving
+// memory that other threads may be copying from.
+static void fs_map_store(void) {
+    if (!g_opts.use_mmap) return;
+
+    g_map_reserve = (uint64_t)g_super.max_blocks * BLOCK_SIZE;
+    if (g_map_reserve > MMAP_RESERVE) {
+        g_map_reserve = MMAP_RESERVE;
+    }
+    if (g_map_reserve < g_dev_bytes) {
+        g_map_reserve = g_dev_bytes;
+    }
+    void *base = mmap(NULL, g_map_reserve, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fatal("Failed to reserve address space for mmap mode");
+    }
+    void *p = mmap(base, g_dev_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, g_fs_fd, 0);
+    if (p == MAP_FAILED) {
+        fatal("mmap of filesystem file failed");
+    }
+    g_fs_map = p;
+}
+
+static void fs_close_store(void) {
+    if (g_fs_map) {
+        munmap(g_fs_map, g_map_reserve);
+        g_fs_map = NULL;
+    }
+    close(g_fs_fd);
+    g_fs_fd = -1;
+}
+
+// Returns the number of bytes read (short at the end of the image) or -EIO.
+static ssize_t fs_dev_read(void *buf, size_t size, off_t offset) {
+    if (g_fs_map) {
+        uint64_t limit = __atomic_load_n(&g_dev_bytes, __ATOMIC_ACQUIRE);
+        if ((uint64_t)offset >= limit) return 0;
+        if (size > limit - offset) size = limit - offset;
+        memcpy(buf, g_fs_map + offset, size);
+        return size;
+    }
+
+    ssize_t r = pread(g_fs_fd, buf, size, offset);
+    return r < 0 ? -EIO : r;
+}
+
+// Returns size on success or -EIO.
+static ssize_t fs_dev_write(const void *buf, size_t size, off_t offset) {
+    if (g_fs_map) {
+        uint64_t limit = __atomic_load_n(&g_dev_bytes, __ATOMIC_ACQUIRE);
+        if ((uint64_t)offset > limit || size > limit - offset) return -EIO;
+        memcpy(g_fs_map + offset, buf, size);
+        return size;
+    }
+
+    if (pwrite(g_fs_fd, buf, size, offset) != (ssize_t)size) {
+        return -EIO;
+    }
+    return size;
+}
+
+// Describe size bytes of the image at offset as a fuse_buf, for writes: a
+// window into the mapping in mmap mode, otherwise the fd and a position,
+// which lets libfuse splice pages from /dev/fuse into the image directly.
+static void fs_dev_buf(struct fuse_buf *b, size_t size, off_t offset) {
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    if (g_fs_map) {
+        b->mem = g_fs_map + offset;
+    } else {
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->fd = g_fs_fd;
+        b->pos = offset;
+    }
+}
+
+// Make everything written to the image so far durable: data, journal and
+// table all live in the one file, so fdatasync (msync for the mapping)
+// covers them. Returns 0 or -EIO.
+static int fs_dev_sync(void) {
+    if (g_fs_map) {
+        // May grow under us, in reserved space. Lock-free so that
+        // fs_checkpoint can call this with g_table_lock held.
+        uint64_t bytes = __atomic_load_n(&g_dev_bytes, __ATOMIC_ACQUIRE);
+        if (msync(g_fs_map, bytes, MS_SYNC) < 0) {
+            fs_log(LOG_ERROR, "msync failed errno=%d", errno);
+            return -EIO;
+        }
+        return 0;
+    }
+    if (fdatasync(g_fs_fd) < 0) {
+        fs_log(LOG_ERROR, "fdatasync failed errno=%d", errno);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void journal_write(void);
+
+// Group commit for fsync. A caller needs a device flush that starts after
+// its writes did, so one already running doesn't count; but whoever runs
+// the next one covers everyone who arrived before it. Concurrent callers
+// therefore share a single fdatasync instead of queueing one each. Journal
+// records still waiting for the committer are written first.
+static pthread_mutex_t g_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_sync_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t g_sync_started = 0;      // flushes begun
+static uint64_t g_sync_done = 0;         // flushes finished, in order
+static uint64_t g_sync_failed = 0;       // last flush that failed
+static int      g_sync_busy = 0;
+
+static int fs_commit(void) {
+    pthread_mutex_lock(&g_sync_lock);
+    uint64_t target = g_sync_started + 1;
+    while (g_sync_done < target) {
+        if (g_sync_busy) {
+            pthread_cond_wait(&g_sync_cond, &g_sync_lock);
+            continue;
+        }
+        g_sync_busy = 1;
+        uint64_t mine = ++g_sync_started;
+        pthread_mutex_unlock(&g_sync_lock);
+        journal_write();
+        int err = fs_dev_sync();
+        pthread_mutex_lock(&g_sync_lock);
+        if (err < 0) {
+            g_sync_failed = mine;
+        }
+        g_sync_done = mine;
+        g_sync_busy = 0;
+        pthread_cond_broadcast(&g_sync_cond);
+    }
+    // Conservative: a later failure is reported too.
+    int err = g_sync_failed >= target ? -EIO : 0;
+    pthread_mutex_unlock(&g_sync_lock);
+    return err;
+}
+
+// Zero len blocks of the image from start: cheaply if the host filesystem
+// can mark them unwritten, by writing zeros otherwise.
+static int fs_dev_zero(uint32_t start, uint32_t len) {
+    off_t off = (off_t)start * BLOCK_SIZE;
+    off_t bytes = (off_t)len * BLOCK_SIZE;
+    if (fallocate(g_fs_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, bytes) == 0) {
+        return 0;
+    }
+    for (off_t done = 0; done < bytes; done += BLOCK_SIZE) {
+        if (fs_dev_write(g_zero_block, BLOCK_SIZE, off + done) < 0) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// Extend the image by at least want blocks, up to max_blocks. Space is
+// reserved with fallocate so a full host disk shows up here rather than
+// as a failed write later. Returns the number of blocks added.
+// Caller holds g_table_lock.
+static uint32_t fs_dev_grow(uint32_t want) {
+    uint64_t limit = g_super.max_blocks;
+    if (g_fs_map && limit > g_map_reserve / BLOCK_SIZE) {
+        limit = g_map_reserve / BLOCK_SIZE;
+    }
+    if (g_super.block_count >= limit) {
+        return 0;
+    }
+
+    uint64_t add = g_super.block_count / 4;
+    if (add < want) add = want;
+    if (add < GROW_MIN_BLOCKS) add = GROW_MIN_BLOCKS;
+    if (add > limit - g_super.block_count) add = limit - g_super.block_count;
+
+    off_t old_bytes = (off_t)g_super.block_count * BLOCK_SIZE;
+    off_t new_bytes = old_bytes + (off_t)add * BLOCK_SIZE;
+    int err = fallocate(g_fs_fd, 0, old_bytes, new_bytes - old_bytes);
+    if (err != 0 && errno == EOPNOTSUPP) {
+        err = ftruncate(g_fs_fd, new_bytes);
+    }
+    if (err != 0) {
+        fs_log(LOG_WARN, "grow failed blocks=%llu errno=%d", (unsigned long long)add, errno);
+        return 0;
+    }
+
+    if (g_fs_map) {
+        // old_bytes is block aligned; map from the page it falls in.
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t from = old_bytes & ~(page - 1);
+        if (mmap(g_fs_map + from, new_bytes - from, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, g_fs_fd, from) == MAP_FAILED) {
+            fatal("Failed to extend mapping after growing filesystem file");
+        }
+    }
+
+    uint8_t *bitmap = realloc(g_block_bitmap, (new_bytes / BLOCK_SIZE + 7) / 8);
+    if (!bitmap) {
+        fatal("Out of memory");
+    }
+    memset(bitmap + (g_super.block_count + 7) / 8, 0,
+           (new_bytes / BLOCK_SIZE + 7) / 8 - (g_super.block_count + 7) / 8);
+    g_block_bitmap = bitmap;
+    // Bits past the old end of a partly used last byte are already clear.
+
+    g_super.block_count += add;
+    __atomic_add_fetch(&g_free_blocks, add, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_dev_bytes, (uint64_t)new_bytes, __ATOMIC_RELEASE);
+
+    // Persist the new size right away; checkpoints are lazy. While the
+    // committer checkpoints, the device may already have the next
+    // generation's superblock, so the write waits for the end of it.
+    if (g_ckpt.busy) {
+        g_ckpt.grew = 1;
+    } else if (fs_dev_write(&g_super, sizeof(g_super), 0) < 0) {
+        fatal("Failed to write superblock");
+    }
+    fs_log(LOG_INFO, "grow blocks=%llu total=%u", (unsigned long long)add, g_super.block_count);
+    return add;
+}
+
+// ---------- I/O engines ----------
+//
+// Batches of block I/O (cache write-back, readahead and the image runs of
+// a read) go through a pluggable engine, picked with -o io_engine=. "sync"
+// issues one preadv/pwritev per run from the calling thread. "io_uring"
+// queues every block of the batch on a ring, with filesys.db registered as
+// a fixed file and the cache arena as a fixed buffer, and waits once for
+// all of them, so the device sees the whole batch at once instead of one
+// request at a time. Single small accesses (metadata, blocks read into the
+// cache) stay on fs_dev_read/fs_dev_write.
+
+static int sync_submit(const IoRun *runs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        size_t total = 0;
+        for (int k = 0; k < runs[i].cnt; k++) {
+            total += runs[i].iov[k].iov_len;
+        }
+        ssize_t r = runs[i].write ? pwritev(g_fs_fd, runs[i].iov, runs[i].cnt, runs[i].off)
+                                  : preadv(g_fs_fd, runs[i].iov, runs[i].cnt, runs[i].off);
+        if (r != (ssize_t)total) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+#define URING_ENTRIES 256
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    int fixed_bufs;                      // cache arena registered as buffer 0
+    int failed;                          // waiting failed; use sync from now on
+} g_ring = { .fd = -1 };
+static pthread_mutex_t g_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int uring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    }
+    uint8_t *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED ||
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &g_fs_fd, 1) < 0) {
+        close(fd);  // the mappings go away with the process
+        return -EIO;
+    }
+
+    g_ring.fd = fd;
+    g_ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    g_ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    g_ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    g_ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    g_ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    g_ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    g_ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    g_ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    g_ring.sqes = sqes;
+    g_ring.entries = p.sq_entries;
+
+    // Optional: needs RLIMIT_MEMLOCK headroom for the whole arena.
+    if (g_cache_size) {
+        struct iovec arena = { g_cache_data, (size_t)g_cache_size * BLOCK_SIZE };
+        g_ring.fixed_bufs =
+            syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &arena, 1) == 0;
+    }
+    return 0;
+}
+
+// Wait for at least min completions, then reap everything that is ready
+// and add it to *reaped. Sets *err to -EIO if any of them fell short.
+// Returns -errno if waiting itself failed.
+static int uring_reap(unsigned min, unsigned *reaped, int *err) {
+    int ret = 0;
+    if (min > 0 && syscall(__NR_io_uring_enter, g_ring.fd, 0, min,
+                           IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        ret = -errno;
+    }
+    unsigned head = *g_ring.cq_head;
+    unsigned tail = __atomic_load_n(g_ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &g_ring.cqes[head & *g_ring.cq_mask];
+        if (cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data) {
+            *err = -EIO;
+        }
+        (*reaped)++;
+    }
+    __atomic_store_n(g_ring.cq_head, head, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// Publish the *queued SQEs ending at tail and hand them to the kernel,
+// counting what it accepts in *submitted. If it won't take them all, the
+// rest are taken back off the ring (nothing else consumes it while
+// g_ring_lock is held), so only SQEs the kernel owns are ever waited for.
+static int uring_enter(unsigned *tail, unsigned *queued, unsigned *submitted,
+                       unsigned *done, int *err) {
+    __atomic_store_n(g_ring.sq_tail, *tail, __ATOMIC_RELEASE);
+    while (*queued > 0) {
+        int r = syscall(__NR_io_uring_enter, g_ring.fd, *queued, 0, 0, NULL, 0);
+        if (r > 0) {
+            *submitted += r;
+            *queued -= r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EBUSY) && *submitted > *done) {
+            if (uring_reap(1, done, err) < 0) {
+                break;
+            }
+            continue;  // made room, retry
+        }
+        break;
+    }
+    if (*queued == 0) {
+        return 0;
+    }
+
+    fs_log(LOG_ERROR, "io_uring_enter dropped sqes=%u errno=%d", *queued, errno);
+    *tail = __atomic_load_n(g_ring.sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(g_ring.sq_tail, *tail, __ATOMIC_RELEASE);
+    *queued = 0;
+    return -EIO;
+}
+
+// Once waiting on the ring has failed, completions of requests still in
+// flight may arrive at any time, so the ring can't tell one batch from
+// the next any more and every later batch takes the sync path.
+static int uring_submit(const IoRun *runs, uint32_t n) {
+    const uint8_t *arena = g_cache_data;
+    const uint8_t *arena_end = arena + (size_t)g_cache_size * BLOCK_SIZE;
+    unsigned queued = 0, submitted = 0, done = 0;
+    int err = 0, wait_err = 0;
+
+    pthread_mutex_lock(&g_ring_lock);
+    if (g_ring.failed) {
+        pthread_mutex_unlock(&g_ring_lock);
+        return sync_submit(runs, n);
+    }
+    unsigned tail = *g_ring.sq_tail;
+    for (uint32_t i = 0; i < n && !g_ring.failed; i++) {
+        off_t off = runs[i].off;
+        for (int k = 0; k < runs[i].cnt && !g_ring.failed; k++) {
+            const struct iovec *v = &runs[i].iov[k];
+            // Keep no more in flight than the ring (and CQ) can hold.
+            while (submitted + queued - done >= g_ring.entries) {
+                if (queued > 0 && uring_enter(&tail, &queued, &submitted, &done, &err) < 0) {
+                    err = -EIO;
+                }
+                if (submitted > done && (wait_err = uring_reap(1, &done, &err)) < 0) {
+                    g_ring.failed = 1;
+                    break;
+                }
+            }
+            if (g_ring.failed) {
+                break;
+            }
+
+            unsigned slot = tail & *g_ring.sq_mask;
+            struct io_uring_sqe *sqe = &g_ring.sqes[slot];
+            int fixed = g_ring.fixed_bufs && (const uint8_t *)v->iov_base >= arena &&
+                        (const uint8_t *)v->iov_base + v->iov_len <= arena_end;
+            memset(sqe, 0, sizeof(*sqe));
+            if (fixed) {
+                sqe->opcode = runs[i].write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe->addr = (uint64_t)(uintptr_t)v->iov_base;
+                sqe->len = v->iov_len;
+                sqe->buf_index = 0;
+            } else {
+                sqe->opcode = runs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->addr = (uint64_t)(uintptr_t)v;
+                sqe->len = 1;
+            }
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;                 // index into the registered files
+            sqe->off = off;
+            sqe->user_data = v->iov_len; // expected result
+            g_ring.sq_array[slot] = slot;
+            tail++;
+            queued++;
+            off += v->iov_len;
+        }
+    }
+
+    if (queued > 0 && uring_enter(&tail, &queued, &submitted, &done, &err) < 0) {
+        err = -EIO;
+    }
+    while (!g_ring.failed && done < submitted) {
+        if ((wait_err = uring_reap(1, &done, &err)) < 0) {
+            g_ring.failed = 1;
+        }
+    }
+    if (g_ring.failed) {
+        // Roll back anything still queued, then give up on the ring.
+        *g_ring.sq_tail = __atomic_load_n(g_ring.sq_head, __ATOMIC_ACQUIRE);
+        fs_log(LOG_ERROR, "io_uring wait failed errno=%d inflight=%u; using sync",
+               -wait_err, submitted - done);
+        err = -EIO;
+    }
+    pthread_mutex_unlock(&g_ring_lock);
+    return err;
+}
+
+static const IoEngine g_engines[] = {
+    { "sync",     NULL,        sync_submit },
+    { "io_uring", uring_setup, uring_submit },
+};
+static const IoEngine *g_io = &g_engines[0];
+
+static void io_engine_select(void) {
+    if (!g_opts.io_engine) return;
+
+    for (size_t i = 0; i < sizeof(g_engines) / sizeof(g_engines[0]); i++) {
+        if (strcmp(g_engines[i].name, g_opts.io_engine) == 0) {
+            g_io = &g_engines[i];
+            return;
+        }
+    }
+    fatal("Unknown io_engine= (use sync or io_uring)");
+}
+
+// Runs from my_init, after libfuse has daemonized, so stdout and stderr
+// are gone and what happens goes to the log. An engine that can't start
+// (old kernel, io_uring disabled) falls back to sync.
+static void io_engine_start(void) {
+    int err = g_io->setup ? g_io->setup() : 0;
+    if (err < 0) {
+        fs_log(LOG_WARN, "io_engine=%s unavailable (%s); using sync",
+               g_io->name, strerror(-err));
+        g_io = &g_engines[0];
+    } else if (g_io->setup) {
+        fs_log(LOG_INFO, "io_engine=%s%s", g_io->name,
+               g_ring.fixed_bufs ? " with registered buffers" : "");
+    }
+}
+
+static int fs_dev_submit(const IoRun *runs, uint32_t n) {
+    return g_io->submit(runs, n);
+}
+
+// ---------- Block cache ----------
+//
+// Writes that cover only part of a block land here instead of going to the
+// image one small pwrite at a time. Blocks are keyed by physical block,
+// replaced with CLOCK and written back in sorted batches, with runs of
+// adjacent blocks merged into one pwritev, by a flusher thread, on
+// release/fsync, or when a clean victim runs out. Whole blocks still go
+// straight to the image (spliced when possible) and drop any cached copy.
+// Reads take cached blocks from here and the rest from the image. In mmap
+// mode the mapping already does all of this, so the cache stays off.
+//
+// g_cache_lock nests inside g_table_lock. Write-back collects the dirty
+// blocks under it, marks them in flight and drops it for the device I/O,
+// so reads and writes of other blocks carry on meanwhile. A block in
+// flight can still be read, but is not evicted, and writing or dropping
+// it waits for the write to finish: the engine is reading the slot, and a
+// block freed by truncate can never be overwritten with its old contents
+// after it has been handed to another file. One batch is in flight at a
+// time; it owns the write-back scratch arrays. Readahead likewise reads
+// into slots marked CACHE_IO_FILL with the lock dropped: readers take
+// those blocks from the image, which is what is being read, and writers
+// and cache_drop wait for the fill to land.
+
+static uint32_t cache_hash(uint32_t pblk) {
+    return (pblk * 2654435761u) & (g_cache_hash_size - 1);
+}
+
+// Returns the cache slot holding pblk, or CACHE_NONE. Caller holds
+// g_cache_lock.
+static uint32_t cache_lookup(uint32_t pblk) {
+    for (uint32_t i = g_cache_hash[cache_hash(pblk)]; i != CACHE_NONE; i = g_cache[i].next) {
+        if (g_cache[i].pblk == pblk) {
+            return i;
+        }
+    }
+    return CACHE_NONE;
+}
+
+static void cache_unhash(uint32_t i) {
+    uint32_t *p = &g_cache_hash[cache_hash(g_cache[i].pblk)];
+    while (*p != i) {
+        p = &g_cache[*p].next;
+    }
+    *p = g_cache[i].next;
+    g_cache[i].pblk = 0;
+}
+
+static int cache_cmp(const void *a, const void *b) {
+    uint32_t x = g_cache[*(const uint32_t *)a].pblk;
+    uint32_t y = g_cache[*(const uint32_t *)b].pblk;
+    return x < y ? -1 : x > y;
+}
+
+static int chunk_flush_locked(uint32_t owner);
+static int chunk_block_read(uint32_t pblk, uint8_t *dst);
+
+// Wait until no write-back is in flight. Caller holds g_cache_lock, which
+// is released while waiting.
+static void cache_wait_io(void) {
+    while (g_cache_flushing) {
+        pthread_cond_wait(&g_cache_io_cond, &g_cache_lock);
+    }
+}
+
+// cache_lookup, but first waits until no I/O of a kind in mask
+// (CACHE_IO_*) is in flight on the block. Caller holds g_cache_lock.
+static uint32_t cache_lookup_idle(uint32_t pblk, uint8_t mask) {
+    uint32_t i;
+    while ((i = cache_lookup(pblk)) != CACHE_NONE && (g_cache[i].io & mask)) {
+        pthread_cond_wait(&g_cache_io_cond, &g_cache_lock);
+    }
+    return i;
+}
+
+// Write back the dirty blocks of one file (or all of them for CACHE_NONE).
+// Waits for a batch already in flight first, so everything dirty when
+// this is called is on the device when it returns. Caller holds
+// g_cache_lock, which is released during the I/O (but not with the chunk
+// layer on, which rewrites whole chunks in place).
+static int cache_flush_locked(uint32_t owner) {
+    if (g_chunked) {
+        return chunk_flush_locked(owner);
+    }
+
+    cache_wait_io();
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < g_cache_size && n < g_cache_dirty; i++) {
+        if (g_cache[i].dirty && (owner == CACHE_NONE || g_cache[i].owner == owner)) {
+            g_cache_sort[n++] = i;
+        }
+    }
+    qsort(g_cache_sort, n, sizeof(uint32_t), cache_cmp);
+
+    // One run per stretch of adjacent blocks, all handed to the I/O
+    // engine as one batch.
+    uint32_t nruns = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pblk = g_cache[g_cache_sort[i]].pblk;
+        IoRun *prev = nruns ? &g_cache_runs[nruns - 1] : NULL;
+        g_cache_iov[i].iov_base = g_cache_data + (size_t)g_cache_sort[i] * BLOCK_SIZE;
+        g_cache_iov[i].iov_len = BLOCK_SIZE;
+        if (prev && prev->cnt < CACHE_IOV_MAX &&
+            prev->off + (off_t)prev->cnt * BLOCK_SIZE == (off_t)pblk * BLOCK_SIZE) {
+            prev->cnt++;
+        } else {
+            g_cache_runs[nruns++] = (IoRun){ &g_cache_iov[i], 1, (off_t)pblk * BLOCK_SIZE, 1 };
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        g_cache[g_cache_sort[i]].dirty = 0;
+        g_cache[g_cache_sort[i]].io = CACHE_IO_WRITE;
+    }
+    g_cache_dirty -= n;
+    g_cache_flushing = 1;
+    pthread_mutex_unlock(&g_cache_lock);
+
+    int err = fs_dev_submit(g_cache_runs, nruns);
+
+    pthread_mutex_lock(&g_cache_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        CacheBlock *cb = &g_cache[g_cache_sort[i]];
+        cb->io = 0;
+        if (err < 0 && !cb->dirty) {
+            cb->dirty = 1;  // leave it for the next attempt
+            g_cache_dirty++;
+        }
+    }
+    g_cache_flushing = 0;
+    pthread_cond_broadcast(&g_cache_io_cond);
+    if (err < 0) {
+        fs_log(LOG_ERROR, "cache write-back failed blocks=%u", n);
+        return -EIO;
+    }
+    return 0;
+}
+
+// One CLOCK sweep for a clean slot to reuse; CACHE_NONE if every block is
+// dirty. Caller holds g_cache_lock.
+static uint32_t cache_scan(void) {
+    for (uint32_t n = 0; n < 2 * g_cache_size; n++) {
+        uint32_t i = g_cache_hand;
+        g_cache_hand = (g_cache_hand + 1) % g_cache_size;
+        if (g_cache[i].pblk == 0) {
+            return i;
+        }
+        if (g_cache[i].dirty || g_cache[i].io) {
+            continue;
+        }
+        if (g_cache[i].ref) {
+            g_cache[i].ref = 0;
+            continue;
+        }
+        cache_unhash(i);
+        return i;
+    }
+    return CACHE_NONE;
+}
+
+// Pick a clean slot to reuse, writing everything back if there is none.
+// Other threads can take the slots that frees up while the write-back has
+// the lock dropped, so it tries a few times. Caller holds g_cache_lock.
+static uint32_t cache_victim(void) {
+    uint32_t i = cache_scan();
+    for (int tries = 0; i == CACHE_NONE && tries < 3; tries++) {
+        if (cache_flush_locked(CACHE_NONE) < 0) {
+            break;
+        }
+        i = cache_scan();
+    }
+    return i;
+}
+
+// Give pblk, which is not cached, a clean slot: zeros if it is fresh,
+// otherwise its contents as stored. Returns the slot or CACHE_NONE.
+// Caller holds g_cache_lock.
+static uint32_t cache_fill(uint32_t pblk, int fresh) {
+    uint32_t i;
+    for (;;) {
+        if ((i = cache_victim()) == CACHE_NONE) {
+            return CACHE_NONE;
+        }
+        // Write-back may have dropped the lock: someone else can have
+        // cached pblk meanwhile, or still be reading it in
+        uint32_t j = cache_lookup(pblk);
+        if (j == CACHE_NONE) {
+            break;
+        }
+        if (!g_cache[j].io) {
+            return j;
+        }
+        pthread_cond_wait(&g_cache_io_cond, &g_cache_lock);
+    }
+    uint8_t *data = g_cache_data + (size_t)i * BLOCK_SIZE;
+    if (fresh) {
+        memset(data, 0, BLOCK_SIZE);
+    } else if (g_chunked ? chunk_block_read(pblk, data) < 0
+                         : fs_dev_read(data, BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) != BLOCK_SIZE) {
+        return CACHE_NONE;
+    }
+    g_cache[i].pblk = pblk;
+    g_cache[i].dirty = 0;
+    g_cache[i].ref = 1;
+    g_cache[i].io = 0;
+    g_cache[i].next = g_cache_hash[cache_hash(pblk)];
+    g_cache_hash[cache_hash(pblk)] = i;
+    return i;
+}
+
+// Copy len bytes from src into pblk at in-block offset off. A fresh block
+// starts out as zeros; any other block is read in first. A block being
+// written back is waited for. Returns the bytes copied or a negative errno.
+static ssize_t cache_write(uint32_t pblk, uint32_t owner, int fresh,
+                           struct fuse_bufvec *src, size_t off, size_t len) {
+    pthread_mutex_lock(&g_cache_lock);
+    uint32_t i = cache_lookup_idle(pblk, CACHE_IO_WRITE | CACHE_IO_FILL);
+    if (i == CACHE_NONE && (i = cache_fill(pblk, fresh)) == CACHE_NONE) {
+        pthread_mutex_unlock(&g_cache_lock);
+        return -EIO;
+    }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].mem = g_cache_data + (size_t)i * BLOCK_SIZE + off;
+    ssize_t w = fuse_buf_copy(&dst, src, 0);
+
+    g_cache[i].owner = owner;
+    g_cache[i].ref = 1;
+    if (!g_cache[i].dirty) {
+        g_cache[i].dirty = 1;
+        g_cache_dirty++;
+    }
+    if (g_cache_dirty > g_cache_size / 2) {
+        pthread_cond_signal(&g_cache_cond);
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return w;
+}
+
+// Give len fresh blocks from start cached zeros, for the chunk layer to
+// write back. Returns 0 or -EIO.
+static int cache_zero(uint32_t owner, uint32_t start, uint32_t len) {
+    for (uint32_t b = start; b < start + len; b++) {
+        struct fuse_bufvec zero = FUSE_BUFVEC_INIT(BLOCK_SIZE);
+        zero.buf[0].mem = (void *) g_zero_block;
+        if (cache_write(b, owner, 1, &zero, 0, BLOCK_SIZE) != BLOCK_SIZE) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// Forget cached copies of len blocks from start, dirty or not: they were
+// freed, or are about to be overwritten in full. A copy being written back
+// is waited for, so it can't land on top of what comes next.
+static void cache_drop(uint32_t start, uint32_t len) {
+    if (g_cache_size == 0) return;
+
+    pthread_mutex_lock(&g_cache_lock);
+    for (uint32_t b = start; b < start + len; b++) {
+        uint32_t i = cache_lookup_idle(b, CACHE_IO_WRITE | CACHE_IO_FILL);
+        if (i != CACHE_NONE) {
+            if (g_cache[i].dirty) {
+                g_cache_dirty--;
+            }
+            g_cache[i].dirty = 0;
+            cache_unhash(i);
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+static int cache_flush(uint32_t owner) {
+    if (g_cache_size == 0) return 0;
+
+    pthread_mutex_lock(&g_cache_lock);
+    int err = cache_flush_locked(owner);
+    pthread_mutex_unlock(&g_cache_lock);
+    return err;
+}
+
+static void *cache_flusher(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&g_cache_lock);
+    while (g_flusher_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CACHE_FLUSH_SECS;
+        pthread_cond_timedwait(&g_cache_cond, &g_cache_lock, &ts);
+        if (g_cache_dirty > 0) {
+            cache_flush_locked(CACHE_NONE);
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return NULL;
+}
+
+// The flusher is started from my_init, after libfuse has daemonized.
+static void cache_start_flusher(void) {
+    if (g_cache_size == 0) return;
+
+    g_flusher_running = 1;
+    if (pthread_create(&g_flusher, NULL, cache_flusher, NULL) != 0) {
+        fatal("Failed to start cache flusher");
+    }
+}
+
+static void cache_stop_flusher(void) {
+    if (!g_flusher_running) return;
+
+    pthread_mutex_lock(&g_cache_lock);
+    g_flusher_running = 0;
+    pthread_cond_signal(&g_cache_cond);
+    pthread_mutex_unlock(&g_cache_lock);
+    pthread_join(g_flusher, NULL);
+}
+
+static void cache_setup(void) {
+    uint64_t bytes = g_opts.cache_size ? parse_size(g_opts.cache_size) : CACHE_DEFAULT_SIZE;
+    if (g_opts.cache_size && bytes == 0 && strcmp(g_opts.cache_size, "0") != 0) {
+        fatal("Invalid cache_size= option");
+    }
+    if (g_fs_map || bytes < BLOCK_SIZE) {
+        return;  // mmap mode or cache_size=0
+    }
+    if (bytes / BLOCK_SIZE > UINT32_MAX / 2) {
+        bytes = (uint64_t)UINT32_MAX / 2 * BLOCK_SIZE;
+    }
+
+    g_cache_size = bytes / BLOCK_SIZE;
+    g_cache_hash_size = 1;
+    while (g_cache_hash_size < g_cache_size) {
+        g_cache_hash_size <<= 1;
+    }
+    g_cache = xcalloc(g_cache_size, sizeof(CacheBlock));
+    g_cache_sort = xcalloc(g_cache_size, sizeof(uint32_t));
+    g_cache_iov = xcalloc(g_cache_size, sizeof(struct iovec));
+    g_cache_runs = xcalloc(g_cache_size, sizeof(IoRun));
+    g_cache_hash = xcalloc(g_cache_hash_size, sizeof(uint32_t));
+    memset(g_cache_hash, 0xFF, g_cache_hash_size * sizeof(uint32_t));  // CACHE_NONE
+    if (posix_memalign((void **)&g_cache_data, BLOCK_SIZE, (size_t)g_cache_size * BLOCK_SIZE) != 0) {
+        fatal("Out of memory");
+    }
+}
+
+// ---------- Compression ----------
+//
+// With -o compress=, data is stored in chunks of CHUNK_BLOCKS physical
+// blocks. When dirty blocks are written back, the whole chunk they belong
+// to is put together from the cache and the image, compressed, and
+// written to the start of the chunk; the blocks it no longer needs are
+// punched out of the image. The map records how each chunk is stored, so
+// reads know whether to decompress. Block numbers and extents don't
+// change, so the allocator and extent maps never see any of this.
+//
+// Everything goes through the block cache then: reads fill it from
+// decompressed chunks (kept in a few views, so a chunk read block by block
+// is only decompressed once) and writes, whole blocks included, are only
+// compressed on their way out. Chunks holding metadata or an overflow
+// extent block, which are written in place, and chunks that reach past the
+// end of the image always stay raw. Caller holds g_cache_lock throughout.
+
+static int chunk_compressed(uint32_t c) {
+    return c < g_super.map_chunks && g_chunk_map[c] != CHUNK_RAW;
+}
+
+static int chunk_packable(uint32_t c) {
+    uint64_t first = (uint64_t)c * CHUNK_BLOCKS;
+    return g_compress != CHUNK_RAW && c < g_super.map_chunks &&
+           g_chunk_pins[c] == 0 && first >= g_super.data_start &&
+           (first + CHUNK_BLOCKS) * BLOCK_SIZE <= __atomic_load_n(&g_dev_bytes, __ATOMIC_ACQUIRE);
+}
+
+static void chunk_map_set(uint32_t c, uint8_t m) {
+    if (g_chunk_map[c] != m) {
+        g_chunk_map[c] = m;
+        g_map_dirty[c / BLOCK_SIZE / 8] |= (uint8_t)(1u << (c / BLOCK_SIZE % 8));
+        g_map_changed = 1;
+    }
+}
+
+// Write the changed blocks of the map. Returns 0 or -EIO.
+static int chunk_map_write(void) {
+    if (!g_map_changed) return 0;
+
+    uint32_t blocks = (g_super.map_chunks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (!(g_map_dirty[b / 8] & (1u << (b % 8)))) continue;
+        size_t off = (size_t)b * BLOCK_SIZE;
+        size_t len = g_super.map_chunks - off < BLOCK_SIZE ? g_super.map_chunks - off : BLOCK_SIZE;
+        if (fs_dev_write(g_chunk_map + off, len, CHUNK_MAP_OFFSET + off) < 0) {
+            fs_log(LOG_ERROR, "chunk map write failed");
+            return -EIO;
+        }
+        g_map_dirty[b / 8] &= (uint8_t)~(1u << (b % 8));
+    }
+    g_map_changed = 0;
+    return 0;
+}
+
+// Compress CHUNK_BYTES from src into at most cap bytes of dst. Returns the
+// compressed length, or 0 if it doesn't fit.
+static size_t chunk_pack(int algo, const uint8_t *src, uint8_t *dst, size_t cap) {
+    switch (algo) {
+#ifdef HAVE_LZ4
+    case CHUNK_LZ4: {
+        int n = LZ4_compress_default((const char *)src, (char *)dst, CHUNK_BYTES, (int)cap);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CHUNK_ZSTD: {
+        size_t n = ZSTD_compressCCtx(g_zstd_cctx, dst, cap, src, CHUNK_BYTES, ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        (void) src; (void) dst; (void) cap;
+        return 0;
+    }
+}
+
+// Returns 0, or -EIO if src doesn't decompress to exactly CHUNK_BYTES.
+static int chunk_unpack(int algo, const uint8_t *src, size_t len, uint8_t *dst) {
+    switch (algo) {
+#ifdef HAVE_LZ4
+    case CHUNK_LZ4:
+        return LZ4_decompress_safe((const char *)src, (char *)dst, (int)len,
+                                   CHUNK_BYTES) == CHUNK_BYTES ? 0 : -EIO;
+#endif
+#ifdef HAVE_ZSTD
+    case CHUNK_ZSTD:
+        return ZSTD_decompressDCtx(g_zstd_dctx, dst, CHUNK_BYTES, src, len) == CHUNK_BYTES ? 0 : -EIO;
+#endif
+    default:
+        (void) src; (void) len; (void) dst;
+        fs_log(LOG_ERROR, "chunk compressed with unsupported algorithm=%d", algo);
+        return -EIO;
+    }
+}
+
+// The contents of chunk c, decompressed if need be, into dst. Blocks past
+// the end of the image read as zeros.
+static int chunk_read(uint32_t c, uint8_t *dst) {
+    off_t off = (off_t)c * CHUNK_BYTES;
+    if (!chunk_compressed(c)) {
+        ssize_t r = fs_dev_read(dst, CHUNK_BYTES, off);
+        if (r < 0) {
+            return -EIO;
+        }
+        memset(dst + r, 0, CHUNK_BYTES - r);
+        return 0;
+    }
+
+    size_t len = (size_t)CHUNK_LEN(g_chunk_map[c]) * BLOCK_SIZE;
+    ChunkHeader h;
+    if (fs_dev_read(g_chunk_zbuf, len, off) != (ssize_t)len) {
+        return -EIO;
+    }
+    memcpy(&h, g_chunk_zbuf, sizeof(h));
+    if (h.clen > len - sizeof(h) ||
+        h.checksum != fs_checksum(g_chunk_zbuf + sizeof(h), h.clen) ||
+        chunk_unpack(CHUNK_ALGO(g_chunk_map[c]), g_chunk_zbuf + sizeof(h), h.clen, dst) < 0) {
+        fs_log(LOG_ERROR, "corrupt compressed chunk=%u", c);
+        return -EIO;
+    }
+    return 0;
+}
+
+// Decompressed chunk c, from a view if one has it. NULL on error.
+static const uint8_t *chunk_view(uint32_t c) {
+    for (int v = 0; v < CHUNK_VIEWS; v++) {
+        if (g_chunk_views[v].chunk == c) {
+            return g_chunk_views[v].data;
+        }
+    }
+    int v = g_chunk_view_next++ % CHUNK_VIEWS;
+    g_chunk_views[v].chunk = UINT32_MAX;
+    if (chunk_read(c, g_chunk_views[v].data) < 0) {
+        return NULL;
+    }
+    g_chunk_views[v].chunk = c;
+    return g_chunk_views[v].data;
+}
+
+static void chunk_view_drop(uint32_t c) {
+    for (int v = 0; v < CHUNK_VIEWS; v++) {
+        if (g_chunk_views[v].chunk == c) {
+            g_chunk_views[v].chunk = UINT32_MAX;
+        }
+    }
+}
+
+// Read block pblk as stored into dst. Returns 0 or -EIO.
+static int chunk_block_read(uint32_t pblk, uint8_t *dst) {
+    uint32_t c = pblk / CHUNK_BLOCKS;
+    if (!chunk_compressed(c)) {
+        return fs_dev_read(dst, BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -EIO;
+    }
+    const uint8_t *v = chunk_view(c);
+    if (v == NULL) {
+        return -EIO;
+    }
+    memcpy(dst, v + (size_t)(pblk % CHUNK_BLOCKS) * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+// Write back chunk c with the cached blocks in it, and mark those clean.
+// A raw chunk that must stay raw only gets its dirty blocks written; any
+// other one is rewritten whole, compressed if it may be and that saves at
+// least a block. With force, a chunk is rewritten even if nothing in it is
+// dirty. Returns 0 or -EIO.
+static int chunk_write(uint32_t c, int force) {
+    uint32_t first = c * CHUNK_BLOCKS;
+    uint32_t slot[CHUNK_BLOCKS];
+    uint32_t dirty = 0;
+    for (uint32_t b = 0; b < CHUNK_BLOCKS; b++) {
+        slot[b] = cache_lookup(first + b);
+        if (slot[b] != CACHE_NONE && g_cache[slot[b]].dirty) {
+            dirty++;
+        }
+    }
+    if (dirty == 0 && !force) {
+        return 0;
+    }
+    chunk_view_drop(c);
+
+    uint64_t out = 0;
+    if (!chunk_packable(c) && !chunk_compressed(c)) {
+        for (uint32_t b = 0; b < CHUNK_BLOCKS; b++) {
+            if (slot[b] == CACHE_NONE || !g_cache[slot[b]].dirty) continue;
+            if (fs_dev_write(g_cache_data + (size_t)slot[b] * BLOCK_SIZE, BLOCK_SIZE,
+                             (off_t)(first + b) * BLOCK_SIZE) < 0) {
+                return -EIO;
+            }
+            out += BLOCK_SIZE;
+        }
+    } else {
+        const uint8_t *old = NULL;
+        for (uint32_t b = 0; b < CHUNK_BLOCKS; b++) {
+            uint8_t *dst = g_chunk_buf + (size_t)b * BLOCK_SIZE;
+            if (slot[b] != CACHE_NONE) {
+                memcpy(dst, g_cache_data + (size_t)slot[b] * BLOCK_SIZE, BLOCK_SIZE);
+                continue;
+            }
+            if (old == NULL && (old = chunk_view(c)) == NULL) {
+                return -EIO;
+            }
+            memcpy(dst, old + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        chunk_view_drop(c);  // old is stale from here on
+
+        size_t room = (CHUNK_BLOCKS - 1) * BLOCK_SIZE - sizeof(ChunkHeader);
+        size_t clen = chunk_packable(c) ? chunk_pack(g_compress, g_chunk_buf,
+                                                     g_chunk_zbuf + sizeof(ChunkHeader), room) : 0;
+        off_t off = (off_t)first * BLOCK_SIZE;
+        if (clen > 0) {
+            ChunkHeader h = { (uint32_t)clen, fs_checksum(g_chunk_zbuf + sizeof(h), clen) };
+            memcpy(g_chunk_zbuf, &h, sizeof(h));
+            size_t used = sizeof(h) + clen;
+            uint32_t blocks = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            memset(g_chunk_zbuf + used, 0, (size_t)blocks * BLOCK_SIZE - used);
+            if (fs_dev_write(g_chunk_zbuf, (size_t)blocks * BLOCK_SIZE, off) < 0) {
+                return -EIO;
+            }
+            // The blocks past the compressed data are dead until the chunk
+            // is rewritten raw; punching gives them back to the host.
+            // Without hole punching only the I/O is saved, and writing
+            // zeros there instead would not free anything, so just say so
+            // once and stop trying.
+            if (g_chunk_punch &&
+                fallocate(g_fs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          off + (off_t)blocks * BLOCK_SIZE,
+                          (off_t)(CHUNK_BLOCKS - blocks) * BLOCK_SIZE) != 0) {
+                if (errno == EOPNOTSUPP) {
+                    fs_log(LOG_WARN, "host cannot punch holes; compressed chunks keep their space");
+                    g_chunk_punch = 0;
+                } else {
+                    fs_log(LOG_WARN, "punch failed chunk=%u errno=%d", c, errno);
+                }
+            }
+            chunk_map_set(c, (uint8_t)(g_compress << 4 | blocks));
+            out = (uint64_t)blocks * BLOCK_SIZE;
+        } else {
+            if (fs_dev_write(g_chunk_buf, CHUNK_BYTES, off) < 0) {
+                return -EIO;
+            }
+            chunk_map_set(c, CHUNK_RAW);
+            out = CHUNK_BYTES;
+        }
+        stats_add(&stats_shard()->chunk_in, CHUNK_BYTES);
+        stats_add(&stats_shard()->chunk_out, out);
+    }
+
+    for (uint32_t b = 0; b < CHUNK_BLOCKS; b++) {
+        if (slot[b] != CACHE_NONE && g_cache[slot[b]].dirty) {
+            g_cache[slot[b]].dirty = 0;
+            g_cache_dirty--;
+        }
+    }
+    return 0;
+}
+
+// cache_flush_locked for the chunk layer: every chunk with a dirty block
+// of owner is written back, other files' blocks in it included.
+static int chunk_flush_locked(uint32_t owner) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < g_cache_size && n < g_cache_dirty; i++) {
+        if (g_cache[i].dirty && (owner == CACHE_NONE || g_cache[i].owner == owner)) {
+            g_cache_sort[n++] = i;
+        }
+    }
+    qsort(g_cache_sort, n, sizeof(uint32_t), cache_cmp);
+
+    int err = 0;
+    uint32_t last = UINT32_MAX;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t c = g_cache[g_cache_sort[i]].pblk / CHUNK_BLOCKS;
+        if (c != last && chunk_write(c, 0) < 0) {
+            err = -EIO;  // leave it dirty for the next attempt
+        }
+        last = c;
+    }
+    if (chunk_map_write() < 0) {
+        err = -EIO;
+    }
+    if (err < 0) {
+        fs_log(LOG_ERROR, "chunk write-back failed");
+    }
+    return err;
+}
+
+static void chunk_pin_count(uint32_t pblk, int delta) {
+    uint32_t c = pblk / CHUNK_BLOCKS;
+    if (c < g_super.map_chunks) {
+        g_chunk_pins[c] += delta;
+    }
+}
+
+// pblk is about to become an overflow extent block, which is written in
+// place: make sure its chunk is stored raw and stays that way. Caller
+// holds g_table_lock, but not g_cache_lock. Returns 0 or -EIO.
+static int chunk_pin(uint32_t pblk) {
+    pthread_mutex_lock(&g_cache_lock);
+    chunk_pin_count(pblk, 1);
+    uint32_t c = pblk / CHUNK_BLOCKS;
+    int err = 0;
+    if (chunk_compressed(c) && (chunk_write(c, 1) < 0 || chunk_map_write() < 0)) {
+        chunk_pin_count(pblk, -1);
+        err = -EIO;
+    }
+    chunk_view_drop(c);
+    pthread_mutex_unlock(&g_cache_lock);
+    return err;
+}
+
+static void chunk_unpin(uint32_t pblk) {
+    pthread_mutex_lock(&g_cache_lock);
+    chunk_pin_count(pblk, -1);
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+// Pick the algorithm and decide whether data I/O needs the chunk layer:
+// with compress= on, or on a volume that got compressed chunks earlier.
+static void chunk_setup(void) {
+    const char *algo = g_opts.compress;
+    if (algo == NULL || strcmp(algo, "off") == 0) {
+        g_compress = CHUNK_RAW;
+    } else if (strcmp(algo, "lz4") == 0) {
+#ifdef HAVE_LZ4
+        g_compress = CHUNK_LZ4;
+#else
+        fatal("compress=lz4: built without LZ4 support");
+#endif
+    } else if (strcmp(algo, "zstd") == 0) {
+#ifdef HAVE_ZSTD
+        g_compress = CHUNK_ZSTD;
+#else
+        fatal("compress=zstd: built without zstd support");
+#endif
+    } else {
+        fatal("Invalid compress= option");
+    }
+
+    g_chunked = g_compress != CHUNK_RAW;
+    for (uint32_t c = 0; c < g_super.map_chunks && !g_chunked; c++) {
+        g_chunked = g_chunk_map[c] != CHUNK_RAW;
+    }
+    if (!g_chunked) return;
+    if (g_cache_size == 0) {
+        fatal("Compressed data needs the block cache (no mmap, cache_size > 0)");
+    }
+
+    g_chunk_buf = xcalloc(1, CHUNK_BYTES);
+    g_chunk_zbuf = xcalloc(1, CHUNK_BYTES);
+    for (int v = 0; v < CHUNK_VIEWS; v++) {
+        g_chunk_views[v].chunk = UINT32_MAX;
+        g_chunk_views[v].data = xcalloc(1, CHUNK_BYTES);
+    }
+#ifdef HAVE_ZSTD
+    g_zstd_cctx = ZSTD_createCCtx();
+    g_zstd_dctx = ZSTD_createDCtx();
+    if (g_zstd_cctx == NULL || g_zstd_dctx == NULL) {
+        fatal("Out of memory");
+    }
+#endif
+}
+
+// ---------- Block allocator ----------
+//
+// Space past the metadata is handed out in BLOCK_SIZE blocks, tracked by an
+// in-memory bitmap. The bitmap is never written out: it is rebuilt from the
+// extent lists whenever the table is loaded, so the journal only has to
+// cover FileEntry changes. g_super.last_alloc follows the highest used
+// block as blocks are marked. Guarded by g_table_lock.
+//
+// Once blocks are deduplicated, several extents can map the same block.
+// g_block_refs (allocated the first time that happens) counts the extra
+// ones, so freeing a shared block only drops a reference. The counts are
+// rebuilt from the extent lists at load like the bitmap. Writers read them
+// without the lock (see block_private).
+
+static int block_is_used(uint32_t b) {
+    return g_block_bitmap[b / 8] & (1u << (b % 8));
+}
+
+static void block_mark(uint32_t start, uint32_t len, int used) {
+    int32_t delta = 0;
+    for (uint32_t b = start; b < start + len; b++) {
+        uint8_t bit = (uint8_t)(1u << (b % 8));
+        if (used && !(g_block_bitmap[b / 8] & bit)) {
+            g_block_bitmap[b / 8] |= bit;
+            delta--;
+        } else if (!used && (g_block_bitmap[b / 8] & bit)) {
+            g_block_bitmap[b / 8] &= (uint8_t)~bit;
+            delta++;
+        }
+    }
+    __atomic_add_fetch(&g_free_blocks, (uint32_t)delta, __ATOMIC_RELAXED);
+
+    uint32_t top = g_super.last_alloc / BLOCK_SIZE;
+    if (used && start + len > top) {
+        g_super.last_alloc = (uint64_t)(start + len) * BLOCK_SIZE;
+    } else if (!used && len > 0 && start + len >= top) {
+        // The top run went away: walk down to the next used block. The
+        // metadata blocks are always used, so this stops at data_start.
+        uint32_t b = start;
+        while (b > 0) {
+            if (b % 8 == 0 && g_block_bitmap[b / 8 - 1] == 0) {
+                b -= 8;
+            } else if (!block_is_used(b - 1)) {
+                b--;
+            } else {
+                break;
+            }
+        }
+        g_super.last_alloc = (uint64_t)b * BLOCK_SIZE;
+    }
+}
+
+static int journal_write_locked(void);
+
+// Allocate up to want contiguous blocks, preferring a run that starts at
+// goal (so a file that grows keeps growing in place), then the first run
+// of at least want blocks at or after goal, wrapping around once. If no
+// run is long enough we take the longest one seen. The image is grown
+// first when free space runs low. Returns the number of blocks allocated
+// (0 when the device is full) and the first one in *start.
+static uint32_t block_alloc(uint32_t goal, uint32_t want, uint32_t *start) {
+    // Blocks freed by a record still waiting could come back here. Data
+    // written to them must not reach the image before that record is on
+    // the device, or replay after a power loss would give the blocks back
+    // to their old owner with the new owner's data in them. A pwrite alone
+    // does not order the two, so the record is flushed too.
+    if (g_journal_frees && journal_write_locked() < 0) {
+        *start = 0;
+        return 0;
+    }
+    if (g_free_blocks < want || g_free_blocks < g_super.block_count / 16) {
+        fs_dev_grow(want);
+    }
+
+    if (goal < g_super.data_start || goal >= g_super.block_count) {
+        goal = g_super.data_start;
+    }
+
+    uint32_t best = 0, best_len = 0;
+    for (int pass = 0; pass < 2 && best_len < want; pass++) {
+        uint32_t b   = pass == 0 ? goal : g_super.data_start;
+        uint32_t end = pass == 0 ? g_super.block_count : goal;
+        while (b < end && best_len < want) {
+            if (b % 8 == 0 && g_block_bitmap[b / 8] == 0xFF) {
+                b += 8;
+                continue;
+            }
+            if (block_is_used(b)) {
+                b++;
+                continue;
+            }
+            uint32_t run = 0;
+            while (run < want && b + run < end && !block_is_used(b + run)) {
+                run++;
+            }
+            if (run > best_len) {
+                best = b;
+                best_len = run;
+            }
+            b += run;
+        }
+    }
+
+    if (best_len > 0) {
+        block_mark(best, best_len, 1);
+    }
+    *start = best;
+    return best_len;
+}
+
+static uint8_t block_refs(uint32_t b) {
+    return g_block_refs ? __atomic_load_n(&g_block_refs[b], __ATOMIC_RELAXED) : 0;
+}
+
+static void block_set_refs(uint32_t b, uint8_t r) {
+    __atomic_store_n(&g_block_refs[b], r, __ATOMIC_RELAXED);
+}
+
+static void block_refs_alloc(void) {
+    if (g_block_refs == NULL) {
+        g_block_refs = xcalloc(g_super.max_blocks, 1);
+    }
+}
+
+// Drop one reference to each block of the run. Blocks nobody else maps
+// are freed, and leave the dedup index.
+static void block_free(uint32_t start, uint32_t len) {
+    g_blocks_freed = 1;
+    if (g_block_refs == NULL) {
+        cache_drop(start, len);
+        block_mark(start, len, 0);
+        return;
+    }
+
+    uint32_t run = start;  // first block of the run being freed
+    for (uint32_t b = start; b < start + len; b++) {
+        uint8_t r = block_refs(b);
+        if ((r & REF_SHARES) == 0) {
+            if (r) block_set_refs(b, 0);
+            continue;
+        }
+        block_set_refs(b, r - 1);
+        if (b > run) {
+            cache_drop(run, b - run);
+            block_mark(run, b - run, 0);
+        }
+        run = b + 1;
+    }
+    if (start + len > run) {
+        cache_drop(run, start + len - run);
+        block_mark(run, start + len - run, 0);
+    }
+}
+
+// Mark an extent's blocks used at load. Blocks an earlier extent already
+// has were deduplicated and get another reference instead.
+static void block_claim(uint32_t start, uint32_t len) {
+    for (uint32_t b = start; b < start + len; b++) {
+        if (!block_is_used(b)) {
+            block_mark(b, 1, 1);
+            continue;
+        }
+        block_refs_alloc();
+        if ((block_refs(b) & REF_SHARES) == REF_SHARES) {
+            fatal("Block mapped more often than reference counts allow");
+        }
+        block_set_refs(b, block_refs(b) + 1);
+    }
+}
+
+// How many blocks from pblk, up to n, can be written in place: those no
+// other extent maps and the dedup index doesn't list. Only the file
+// mapping a block can make it shareable and only under g_table_lock, so
+// the caller's exclusive slot lock is enough to trust a zero here.
+static uint32_t block_private(uint32_t pblk, uint32_t n) {
+    if (g_block_refs == NULL) {
+        return n;
+    }
+    uint32_t i = 0;
+    while (i < n && block_refs(pblk + i) == 0) {
+        i++;
+    }
+    return i;
+}
+
+// ---------- Deduplication ----------
+//
+// With -o dedup, every whole block a file write covers is hashed first.
+// If the index has a block with the same hash, and its contents really
+// are the same, the file maps that block and takes another reference to
+// it instead of writing. Otherwise the block is written as usual and then
+// listed. A block that is listed or shared is never written in place: the
+// file writing it takes it out of the index first, and if other extents
+// still map it, moves to a copy (see file_unshare).
+//
+// The index only remembers what was written since mount, and may forget
+// or point at blocks that changed since, which the comparison catches. So
+// it is not persisted, and dedup only finds copies written in the same
+// mount session. Only the extent lists are persisted, and they are enough
+// to rebuild the reference counts.
+
+// XXH64's inner loop over a whole block: four lanes of multiply-rotate,
+// merged and mixed at the end. Not collision resistant, which is why hits
+// are compared byte for byte.
+static uint64_t block_hash(const uint8_t *data) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t v[4] = { p1 + p2, p2, 0, -p1 };
+    for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, data + i + l * 8, sizeof(w));
+            v[l] += w * p2;
+            v[l] = (v[l] << 31 | v[l] >> 33) * p1;
+        }
+    }
+    uint64_t h = (v[0] << 1 | v[0] >> 63) + (v[1] << 7 | v[1] >> 57) +
+                 (v[2] << 12 | v[2] >> 52) + (v[3] << 18 | v[3] >> 46);
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Block pblk as the file would read it: from the cache if it is there
+// (possibly dirty), else from the image. Returns 0 or -EIO.
+static int block_read_current(uint32_t pblk, uint8_t *dst) {
+    if (g_cache_size == 0) {
+        return fs_dev_read(dst, BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -EIO;
+    }
+    pthread_mutex_lock(&g_cache_lock);
+    int err = 0;
+    uint32_t i = cache_lookup(pblk);
+    if (i != CACHE_NONE && !(g_cache[i].io & CACHE_IO_FILL)) {
+        memcpy(dst, g_cache_data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    } else if (g_chunked) {
+        err = chunk_block_read(pblk, dst);
+    } else if (fs_dev_read(dst, BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) != BLOCK_SIZE) {
+        err = -EIO;
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return err;
+}
+
+// Write pblk back now if the cache holds it dirty. A block that gets
+// shared belongs to the file that wrote it as far as the cache is
+// concerned, so an fsync of the other file would not flush it.
+static int cache_clean(uint32_t pblk) {
+    if (g_cache_size == 0) return 0;
+
+    pthread_mutex_lock(&g_cache_lock);
+    int err = 0;
+    // An older copy being written back may still land after ours
+    uint32_t i = cache_lookup_idle(pblk, CACHE_IO_WRITE);
+    if (i != CACHE_NONE && g_cache[i].dirty) {
+        if (g_chunked) {
+            err = chunk_write(pblk / CHUNK_BLOCKS, 0) < 0 || chunk_map_write() < 0 ? -EIO : 0;
+        } else if (fs_dev_write(g_cache_data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE,
+                                (off_t)pblk * BLOCK_SIZE) < 0) {
+            err = -EIO;
+        } else {
+            g_cache[i].dirty = 0;
+            g_cache_dirty--;
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return err;
+}
+
+// A listed block holding exactly data that can take another reference,
+// or 0. A hash match counts only once the whole block compares equal, so
+// a collision never shares the wrong contents. Entries that turn out
+// stale are dropped. Caller holds g_table_lock.
+static uint32_t dedup_lookup(uint64_t hash, const uint8_t *data) {
+    DedupEntry *set = &g_dedup_index[(hash & (g_dedup_sets - 1)) * DEDUP_WAYS];
+    uint8_t old[BLOCK_SIZE];
+    for (int w = 0; w < DEDUP_WAYS; w++) {
+        DedupEntry *e = &set[w];
+        if (e->pblk == 0 || e->hash != hash) continue;
+        uint8_t r = block_refs(e->pblk);
+        if (!(r & REF_HASHED) || block_read_current(e->pblk, old) < 0 ||
+            memcmp(old, data, BLOCK_SIZE) != 0) {
+            e->pblk = 0;
+            continue;
+        }
+        if ((r & REF_SHARES) == REF_SHARES) {
+            return 0;  // as shared as it gets; the new copy replaces it
+        }
+        return e->pblk;
+    }
+    return 0;
+}
+
+// List pblk, just written with data hashing to hash, replacing any entry
+// for the same hash, else an empty or stale one, else one picked by the
+// hash. Caller holds g_table_lock.
+static void dedup_insert(uint64_t hash, uint32_t pblk) {
+    DedupEntry *set = &g_dedup_index[(hash & (g_dedup_sets - 1)) * DEDUP_WAYS];
+    DedupEntry *slot = &set[(hash >> 32) % DEDUP_WAYS];
+    for (int w = 0; w < DEDUP_WAYS; w++) {
+        if (set[w].hash == hash ||
+            set[w].pblk == 0 || !(block_refs(set[w].pblk) & REF_HASHED)) {
+            slot = &set[w];
+            break;
+        }
+    }
+    if (slot->pblk != 0 && slot->pblk != pblk) {
+        uint8_t r = block_refs(slot->pblk);
+        block_set_refs(slot->pblk, r & ~REF_HASHED);
+    }
+    slot->hash = hash;
+    slot->pblk = pblk;
+    block_set_refs(pblk, block_refs(pblk) | REF_HASHED);
+}
+
+// Size the index for the volume, within DEDUP_MAX_SETS.
+static void dedup_setup(void) {
+    if (!g_opts.dedup) return;
+
+    block_refs_alloc();
+    g_dedup_sets = 1;
+    while (g_dedup_sets < DEDUP_MAX_SETS &&
+           (uint64_t)g_dedup_sets * DEDUP_WAYS < g_super.max_blocks) {
+        g_dedup_sets <<= 1;
+    }
+    g_dedup_index = xcalloc((size_t)g_dedup_sets * DEDUP_WAYS, sizeof(DedupEntry));
+}
+
+// ---------- Extent maps ----------
+//
+// A file's data is described by runs sorted by logical block. The first
+// DIRECT_EXTENTS live in the FileEntry itself; beyond that, the rest spill
+// into a chain of overflow blocks, OVERFLOW_EXTENTS each, that starts at
+// FileEntry.start and is cached in g_overflow. The chain grows a link at a
+// time, so a file can have as many runs as the volume has room for.
+// Readers need the slot lock; changes need the slot lock exclusively plus
+// g_table_lock.
+
+static Extent *file_extent(int idx, uint32_t i) {
+    if (i < DIRECT_EXTENTS) {
+        return &g_body[idx].extents[i];
+    }
+    return &g_overflow[idx].extents[i - DIRECT_EXTENTS];
+}
+
+// Overflow links needed to hold n extents.
+static uint32_t overflow_links(uint32_t n) {
+    if (n <= DIRECT_EXTENTS) {
+        return 0;
+    }
+    return (n - DIRECT_EXTENTS + OVERFLOW_EXTENTS - 1) / OVERFLOW_EXTENTS;
+}
+
+// Like file_map below, but tries extent *cursor and the one after it before
+// searching, and leaves *cursor at the extent lblk fell in (or the first one
+// after it). Sequential access then maps each run without a search. The
+// cursor is only a guess, so any value is safe.
+static uint32_t file_map_at(int idx, uint32_t lblk, uint32_t *pblk, uint32_t *cursor) {
+    uint32_t n = g_meta[idx].nextents;
+    for (uint32_t i = *cursor; i < n && i <= *cursor + 1; i++) {
+        Extent *e = file_extent(idx, i);
+        if (lblk >= e->lblk && lblk < e->lblk + e->len) {
+            *cursor = i;
+            *pblk = e->pblk + (lblk - e->lblk);
+            return e->len - (lblk - e->lblk);
+        }
+    }
+
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        Extent *e = file_extent(idx, mid);
+        if (lblk < e->lblk) {
+            hi = mid;
+        } else if (lblk >= e->lblk + e->len) {
+            lo = mid + 1;
+        } else {
+            *cursor = mid;
+            *pblk = e->pblk + (lblk - e->lblk);
+            return e->len - (lblk - e->lblk);
+        }
+    }
+    *cursor = lo;
+    *pblk = 0;
+    if (lo < n) {
+        return file_extent(idx, lo)->lblk - lblk;
+    }
+    return UINT32_MAX;
+}
+
+// Map logical block lblk. If it is allocated, *pblk is its physical block
+// and the result is how many blocks stay physically contiguous from there.
+// Otherwise *pblk is 0 and the result is the number of blocks until the
+// next allocated one (UINT32_MAX past the last extent).
+static uint32_t file_map(int idx, uint32_t lblk, uint32_t *pblk) {
+    uint32_t cursor = 0;
+    return file_map_at(idx, lblk, pblk, &cursor);
+}
+
+// Write the links holding extent from and everything after it. They go
+// last first, so no link on disk ever points at one not written yet.
+static void file_write_overflow(int idx, uint32_t from) {
+    struct overflow *ov = &g_overflow[idx];
+    uint32_t first = from < DIRECT_EXTENTS ? 0 : (from - DIRECT_EXTENTS) / OVERFLOW_EXTENTS;
+    OverflowBlock ob;
+    for (uint32_t b = ov->nblocks; b-- > first;) {
+        memcpy(ob.extents, &ov->extents[(size_t)b * OVERFLOW_EXTENTS], sizeof(ob.extents));
+        ob.next = b + 1 < ov->nblocks ? ov->blocks[b + 1] : 0;
+        if (fs_dev_write(&ob, sizeof(ob), (off_t)ov->blocks[b] * BLOCK_SIZE) < 0) {
+            fatal("Failed to write overflow extent block");
+        }
+    }
+}
+
+// Add a link to the end of the chain. Returns 0 or a negative errno.
+static int file_grow_overflow(int idx) {
+    FileMeta *fm = &g_meta[idx];
+    struct overflow *ov = &g_overflow[idx];
+    uint32_t n = ov->nblocks;
+
+    uint32_t ob;
+    if (block_alloc(n ? ov->blocks[n - 1] + 1 : fm->start, 1, &ob) == 0) {
+        return -ENOSPC;
+    }
+    uint32_t *blocks = realloc(ov->blocks, (n + 1) * sizeof(uint32_t));
+    if (blocks) {
+        ov->blocks = blocks;
+    }
+    Extent *extents = realloc(ov->extents, (size_t)(n + 1) * OVERFLOW_EXTENTS * sizeof(Extent));
+    if (extents) {
+        ov->extents = extents;
+    }
+    if (!blocks || !extents) {
+        block_free(ob, 1);
+        return -ENOMEM;
+    }
+    if (chunk_pin(ob) < 0) {
+        block_free(ob, 1);
+        return -EIO;
+    }
+    memset(&ov->extents[(size_t)n * OVERFLOW_EXTENTS], 0, OVERFLOW_EXTENTS * sizeof(Extent));
+    ov->blocks[n] = ob;
+    ov->nblocks = n + 1;
+    if (n == 0) {
+        fm->start = ob;
+    }
+    return 0;
+}
+
+// Insert the run [lblk, lblk + len) -> pblk, merging it with its
+// neighbours when both ranges line up. Returns 0, or -ENOSPC when there is
+// no block left for another overflow link.
+static int file_add_extent(int idx, uint32_t lblk, uint32_t pblk, uint32_t len) {
+    FileMeta *fm = &g_meta[idx];
+
+    uint32_t i = 0;
+    while (i < fm->nextents && file_extent(idx, i)->lblk < lblk) {
+        i++;
+    }
+    uint32_t from = i > 0 ? i - 1 : 0;  // first extent that may change
+
+    if (i > 0) {
+        Extent *prev = file_extent(idx, i - 1);
+        if (prev->lblk + prev->len == lblk && prev->pblk + prev->len == pblk) {
+            prev->len += len;
+            if (i < fm->nextents) {
+                Extent *next = file_extent(idx, i);
+                if (lblk + len == next->lblk && pblk + len == next->pblk) {
+                    prev->len += next->len;
+                    for (uint32_t j = i; j + 1 < fm->nextents; j++) {
+                        *file_extent(idx, j) = *file_extent(idx, j + 1);
+                    }
+                    fm->nextents--;
+                }
+            }
+            goto done;
+        }
+    }
+    if (i < fm->nextents) {
+        Extent *next = file_extent(idx, i);
+        if (lblk + len == next->lblk && pblk + len == next->pblk) {
+            next->lblk = lblk;
+            next->pblk = pblk;
+            next->len += len;
+            goto done;
+        }
+    }
+
+    if (overflow_links(fm->nextents + 1) > g_overflow[idx].nblocks) {
+        int err = file_grow_overflow(idx);
+        if (err < 0) {
+            return err;
+        }
+    }
+    for (uint32_t j = fm->nextents; j > i; j--) {
+        *file_extent(idx, j) = *file_extent(idx, j - 1);
+    }
+    fm->nextents++;
+    Extent *e = file_extent(idx, i);
+    e->lblk = lblk;
+    e->pblk = pblk;
+    e->len  = len;
+
+done:
+    if (fm->nextents > DIRECT_EXTENTS) {
+        file_write_overflow(idx, from);
+    }
+    return 0;
+}
+
+// Allocate blocks for the hole starting at lblk, up to want of them,
+// placed right after the physical block backing lblk - 1 when possible.
+// Returns how many blocks were mapped (with the first in *pblk), or a
+// negative errno.
+static int file_alloc_run(int idx, uint32_t lblk, uint32_t want, uint32_t *pblk) {
+    uint32_t goal = g_super.last_alloc / BLOCK_SIZE;
+    if (lblk > 0) {
+        uint32_t prev;
+        file_map(idx, lblk - 1, &prev);
+        if (prev != 0) {
+            goal = prev + 1;
+        }
+    }
+
+    uint32_t start;
+    uint32_t got = block_alloc(goal, want, &start);
+    if (got == 0) {
+        return -ENOSPC;
+    }
+
+    int err = file_add_extent(idx, lblk, start, got);
+    if (err < 0) {
+        block_free(start, got);
+        return err;
+    }
+    *pblk = start;
+    return (int)got;
+}
+
+// Give back the overflow links the extents no longer need, and write out
+// the rest from extent from on (the new last link always, since its next
+// pointer changes).
+static void file_trim_overflow(int idx, uint32_t from) {
+    FileMeta *fm = &g_meta[idx];
+    struct overflow *ov = &g_overflow[idx];
+    uint32_t keep = overflow_links(fm->nextents);
+    if (keep < ov->nblocks) {
+        for (uint32_t b = keep; b < ov->nblocks; b++) {
+            chunk_unpin(ov->blocks[b]);
+            block_free(ov->blocks[b], 1);
+        }
+        ov->nblocks = keep;
+        if (keep > 0 && from > DIRECT_EXTENTS + (keep - 1) * OVERFLOW_EXTENTS) {
+            from = DIRECT_EXTENTS + (keep - 1) * OVERFLOW_EXTENTS;
+        }
+    }
+    if (keep == 0) {
+        free(ov->blocks);
+        free(ov->extents);
+        memset(ov, 0, sizeof(*ov));
+        fm->start = 0;
+    } else {
+        file_write_overflow(idx, from);
+    }
+}
+
+// Release every block at or past logical block keep. A regular file left
+// with nothing goes back to keeping its data inline.
+static void file_free_from(int idx, uint32_t keep) {
+    FileMeta *fm = &g_meta[idx];
+    if (fm->flags & FE_INLINE) {
+        if (keep == 0) {
+            memset(g_body[idx].data, 0, sizeof(g_body[idx].data));
+        }
+        return;
+    }
+
+    while (fm->nextents > 0) {
+        Extent *e = file_extent(idx, fm->nextents - 1);
+        if (e->lblk + e->len <= keep) {
+            break;
+        }
+        if (e->lblk >= keep) {
+            block_free(e->pblk, e->len);
+            fm->nextents--;
+        } else {
+            uint32_t cut = e->lblk + e->len - keep;
+            block_free(e->pblk + e->len - cut, cut);
+            e->len -= cut;
+        }
+    }
+    file_trim_overflow(idx, fm->nextents > 0 ? fm->nextents - 1 : 0);
+
+    if (keep == 0 && !is_dir(idx) && !g_opts.no_inline) {
+        memset(g_body[idx].data, 0, sizeof(g_body[idx].data));
+        fm->flags |= FE_INLINE;
+    }
+}
+
+// Release the blocks of [first, end), leaving a hole. Returns 0, or
+// -ENOSPC if that splits an extent and there is no room for the far end.
+static int file_free_range(int idx, uint32_t first, uint32_t end) {
+    FileMeta *fm = &g_meta[idx];
+
+    uint32_t i = 0, from = UINT32_MAX;
+    while (i < fm->nextents) {
+        Extent *e = file_extent(idx, i);
+        uint32_t lo = e->lblk, hi = e->lblk + e->len;
+        if (hi <= first) {
+            i++;
+            continue;
+        }
+        if (from == UINT32_MAX) {
+            from = i;
+        }
+        if (lo >= end) {
+            break;
+        }
+
+        if (lo < first && hi > end) {
+            // Map the far end first, so failing leaves everything as it was.
+            int err = file_add_extent(idx, end, e->pblk + (end - lo), hi - end);
+            if (err < 0) {
+                return err;
+            }
+            e = file_extent(idx, i);
+            block_free(e->pblk + (first - lo), end - first);
+            e->len = first - lo;
+            break;
+        } else if (lo < first) {
+            block_free(e->pblk + (first - lo), hi - first);
+            e->len = first - lo;
+            i++;
+        } else if (hi > end) {
+            block_free(e->pblk, end - lo);
+            e->pblk += end - lo;
+            e->lblk = end;
+            e->len = hi - end;
+            i++;
+        } else {
+            block_free(e->pblk, e->len);
+            for (uint32_t j = i; j + 1 < fm->nextents; j++) {
+                *file_extent(idx, j) = *file_extent(idx, j + 1);
+            }
+            fm->nextents--;
+        }
+    }
+    file_trim_overflow(idx, from == UINT32_MAX ? fm->nextents : from);
+    return 0;
+}
+
+static void slot_mark(uint32_t idx, int used) {
+    if (used) {
+        g_slot_bitmap[idx / 64] |= 1ULL << (idx % 64);
+        __atomic_add_fetch(&g_used_slots, 1, __ATOMIC_RELAXED);
+        if (idx >= g_table_high) {
+            g_table_high = idx + 1;
+        }
+    } else {
+        g_slot_bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+        __atomic_sub_fetch(&g_used_slots, 1, __ATOMIC_RELAXED);
+        if (idx < g_slot_hint) {
+            g_slot_hint = idx;
+        }
+    }
+}
+
+// Rebuild the block bitmap and reference counts, the slot bitmap and the
+// overflow extent cache from the loaded file table. Slots at or above
+// g_table_high are known to be free; it is lowered to just past the
+// highest slot actually in use.
+static void fs_rebuild_allocator(void) {
+    uint32_t high = g_table_high;
+    free(g_block_bitmap);
+    g_block_bitmap = xcalloc((g_super.block_count + 7) / 8, 1);
+    __atomic_store_n(&g_free_blocks, g_super.block_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_used_slots, 0, __ATOMIC_RELAXED);
+    g_super.last_alloc = 0;
+    block_mark(0, g_super.data_start, 1);
+
+    memset(g_slot_bitmap, 0, (g_super.max_files + 63) / 64 * sizeof(uint64_t));
+    memset(g_chunk_pins, 0, g_super.map_chunks);
+    if (g_block_refs) {
+        memset(g_block_refs, 0, g_super.max_blocks);
+    }
+    g_slot_hint = 0;
+    g_table_high = 0;
+    for (uint32_t i = 0; i < high; i++) {
+        struct overflow *ov = &g_overflow[i];
+        free(ov->blocks);
+        free(ov->extents);
+        memset(ov, 0, sizeof(*ov));
+
+        FileMeta *fm = &g_meta[i];
+        if (!fm->used) continue;
+        slot_mark(i, 1);
+
+        uint32_t links = overflow_links(fm->nextents);
+        if (links > 0) {
+            ov->blocks = xcalloc(links, sizeof(uint32_t));
+            ov->extents = xcalloc((size_t)links * OVERFLOW_EXTENTS, sizeof(Extent));
+            ov->nblocks = links;
+        }
+        uint32_t blk = fm->start;
+        for (uint32_t b = 0; b < links; b++) {
+            OverflowBlock ob;
+            if (blk < g_super.data_start || blk >= g_super.block_count ||
+                fs_dev_read(&ob, sizeof(ob), (off_t)blk * BLOCK_SIZE) != sizeof(ob)) {
+                fatal("Failed to load overflow extent chain");
+            }
+            memcpy(&ov->extents[(size_t)b * OVERFLOW_EXTENTS], ob.extents, sizeof(ob.extents));
+            ov->blocks[b] = blk;
+            block_mark(blk, 1, 1);
+            chunk_pin_count(blk, 1);
+            blk = ob.next;
+        }
+        for (uint32_t e = 0; e < fm->nextents; e++) {
+            block_claim(file_extent(i, e)->pblk, file_extent(i, e)->len);
+        }
+    }
+}
+
+// Convert slot idx between the in-memory arrays and its on-disk record.
+static void entry_pack(uint32_t idx, FileEntry *fe) {
+    const FileMeta *fm = &g_meta[idx];
+    memset(fe, 0, sizeof(*fe));
+    fe->used     = fm->used;
+    memcpy(fe->name, g_names[idx], NAME_MAX_LEN);
+    fe->parent   = fm->parent;
+    fe->start    = fm->start;
+    fe->size     = fm->size;
+    fe->perms    = fm->perms;
+    fe->mtime    = fm->mtime;
+    fe->nextents = fm->nextents;
+    fe->flags    = fm->flags;
+    memcpy(fe->data, g_body[idx].data, INLINE_MAX);
+}
+
+static void entry_unpack(uint32_t idx, const FileEntry *fe) {
+    FileMeta *fm = &g_meta[idx];
+    memset(fm, 0, sizeof(*fm));
+    fm->used     = fe->used;
+    memcpy(g_names[idx], fe->name, NAME_MAX_LEN);
+    g_names[idx][NAME_MAX_LEN - 1] = '\0';
+    fm->parent   = fe->parent;
+    fm->start    = fe->start;
+    fm->size     = fe->size;
+    fm->perms    = fe->perms;
+    fm->mtime    = fe->mtime;
+    fm->nextents = fe->nextents;
+    fm->flags    = fe->flags;
+    memcpy(g_body[idx].data, fe->data, INLINE_MAX);
+}
+
+static void entry_clear(uint32_t idx) {
+    memset(&g_meta[idx], 0, sizeof(FileMeta));
+    memset(g_names[idx], 0, NAME_MAX_LEN);
+    memset(&g_body[idx], 0, sizeof(FileBody));
+}
+
+static void table_mark_dirty(uint32_t idx) {
+    g_table_dirty[idx / TABLE_CHUNK / 8] |= (uint8_t)(1u << (idx / TABLE_CHUNK % 8));
+}
+
+static int table_chunk_dirty(uint32_t chunk) {
+    return g_table_dirty[chunk / 8] & (1u << (chunk % 8));
+}
+
+// Write n records from src to slots first..first+n-1.
+static int table_write(const FileEntry *src, uint32_t first, uint32_t n) {
+    if (fs_dev_write(src, (size_t)n * sizeof(FileEntry),
+                     sizeof(g_super) + (off_t)first * sizeof(FileEntry)) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+// Write the changed parts of the file table and the superblock to their
+// fixed location and start a new journal generation, which invalidates
+// every record logged so far. The table goes first and is flushed before
+// the superblock is written: if we crash before the superblock lands, the
+// old generation is still valid and simply replays on top of it. The
+// superblock is flushed in turn before the journal is reused, so new
+// records never overwrite old ones the device might still need. This is
+// the inline form, for mount, unmount and a full journal; while mounted,
+// the committer checkpoints without g_table_lock (journal_checkpoint).
+// Returns 0, or -EIO with the journal left as it was. Caller holds
+// g_table_lock.
+static int fs_checkpoint(void) {
+    if (g_fs_fd < 0) return 0;
+
+    // Runs of dirty chunks are converted into g_table_buf and written
+    // with one call per TABLE_BATCH entries.
+    uint32_t chunks = (g_super.max_files + TABLE_CHUNK - 1) / TABLE_CHUNK;
+    uint32_t first = 0, staged = 0;
+    int err = 0;
+    for (uint32_t c = 0; c < chunks && err == 0; c++) {
+        if (!table_chunk_dirty(c)) continue;
+
+        uint32_t lo = c * TABLE_CHUNK;
+        uint32_t hi = lo + TABLE_CHUNK;
+        if (hi > g_super.max_files) {
+            hi = g_super.max_files;
+        }
+        if (staged > 0 && (first + staged != lo || staged + TABLE_CHUNK > TABLE_BATCH)) {
+            err = table_write(g_table_buf, first, staged);
+            staged = 0;
+        }
+        if (staged == 0) {
+            first = lo;
+        }
+        for (uint32_t i = lo; i < hi; i++) {
+            entry_pack(i, &g_table_buf[staged++]);
+        }
+    }
+    if (err == 0 && staged > 0) {
+        err = table_write(g_table_buf, first, staged);
+    }
+    if (err == 0 && fs_dev_sync() != 0) {
+        err = -EIO;
+    }
+    if (err < 0) {
+        fs_log(LOG_ERROR, "checkpoint failed writing the file table");
+        return err;
+    }
+
+    // A batch still in flight must land before the journal is reused.
+    pthread_mutex_lock(&g_journal_io);
+    Superblock sb = g_super;
+    sb.table_high = g_table_high;
+    sb.journal_gen++;
+    if (fs_dev_write(&sb, sizeof(sb), 0) < 0 || fs_dev_sync() != 0) {
+        // The device may have either one now; the journal stays in the
+        // old generation, so put its superblock back.
+        fs_dev_write(&g_super, sizeof(g_super), 0);
+        pthread_mutex_unlock(&g_journal_io);
+        fs_log(LOG_ERROR, "checkpoint failed writing the superblock");
+        return -EIO;
+    }
+    memset(g_table_dirty, 0, (chunks + 7) / 8);
+    g_super.table_high = sb.table_high;
+    g_super.journal_gen = sb.journal_gen;
+
+    // Records not written yet are in the table now, and out of date.
+    g_journal_next = 0;
+    g_journal_claimed = 0;
+    g_journal_written = 0;
+    g_journal_frees = 0;
+    pthread_mutex_unlock(&g_journal_io);
+    g_last_checkpoint = time(NULL);
+    return 0;
+}
+
+// The committer's checkpoint comes in three parts. checkpoint_begin copies
+// the dirty chunks and a superblock for the next generation under
+// g_table_lock. checkpoint_write puts them on the device, in the same order
+// and with the same flushes as fs_checkpoint, with only g_journal_io held,
+// while logging carries on in the current generation. checkpoint_end_locked
+// then moves the records logged meanwhile to the front of the journal,
+// restamped for the new generation. Between the write and the end the
+// superblock on the device may already be the new one, so the journal must
+// not be written at the old positions. Whoever takes g_journal_io first
+// after the write therefore ends the checkpoint before anything else.
+// Grow leaves its superblock write to the end as well.
+
+// Copy what the checkpoint writes. Returns 0, or -ENOMEM with nothing
+// changed. Caller holds g_table_lock and no checkpoint is busy.
+static int checkpoint_begin(void) {
+    uint32_t chunks = (g_super.max_files + TABLE_CHUNK - 1) / TABLE_CHUNK;
+    uint32_t n = 0;
+    for (uint32_t c = 0; c < chunks; c++) {
+        n += table_chunk_dirty(c) != 0;
+    }
+    if (n > g_ckpt.cap) {
+        FileEntry *buf = realloc(g_ckpt.buf, (size_t)n * TABLE_CHUNK * sizeof(FileEntry));
+        if (buf != NULL) {
+            g_ckpt.buf = buf;
+        }
+        uint32_t *list = realloc(g_ckpt.chunks, (size_t)n * sizeof(uint32_t));
+        if (list != NULL) {
+            g_ckpt.chunks = list;
+        }
+        if (buf == NULL || list == NULL) {
+            fs_log(LOG_WARN, "checkpoint deferred: no memory for chunks=%u", n);
+            return -ENOMEM;
+        }
+        g_ckpt.cap = n;
+    }
+
+    g_ckpt.nchunks = 0;
+    for (uint32_t c = 0; c < chunks; c++) {
+        if (!table_chunk_dirty(c)) continue;
+
+        FileEntry *dst = &g_ckpt.buf[(size_t)g_ckpt.nchunks * TABLE_CHUNK];
+        uint32_t hi = (c + 1) * TABLE_CHUNK;
+        if (hi > g_super.max_files) {
+            hi = g_super.max_files;
+        }
+        for (uint32_t i = c * TABLE_CHUNK; i < hi; i++) {
+            entry_pack(i, dst++);
+        }
+        g_ckpt.chunks[g_ckpt.nchunks++] = c;
+    }
+    memset(g_table_dirty, 0, (chunks + 7) / 8);
+
+    g_ckpt.next = g_journal_next;
+    g_ckpt.super = g_super;
+    g_ckpt.super.table_high = g_table_high;
+    g_ckpt.super.journal_gen++;
+    g_ckpt.busy = 1;
+    g_ckpt.failed = 0;
+    g_ckpt.grew = 0;
+    return 0;
+}
+
+// Write the copy: the table chunks, one call per run of adjacent ones, a
+// flush, then the superblock and another flush. Caller holds g_journal_io.
+static int checkpoint_write(void) {
+    uint32_t max_files = g_ckpt.super.max_files;
+    for (uint32_t i = 0; i < g_ckpt.nchunks; ) {
+        uint32_t j = i + 1;
+        while (j < g_ckpt.nchunks && g_ckpt.chunks[j] == g_ckpt.chunks[j - 1] + 1) {
+            j++;
+        }
+        uint32_t lo = g_ckpt.chunks[i] * TABLE_CHUNK;
+        uint32_t hi = (g_ckpt.chunks[j - 1] + 1) * TABLE_CHUNK;
+        if (hi > max_files) {
+            hi = max_files;
+        }
+        if (table_write(&g_ckpt.buf[(size_t)i * TABLE_CHUNK], lo, hi - lo) < 0) {
+            return -EIO;
+        }
+        i = j;
+    }
+    if (fs_dev_sync() != 0) {
+        return -EIO;
+    }
+    if (fs_dev_write(&g_ckpt.super, sizeof(g_ckpt.super), 0) < 0 || fs_dev_sync() != 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+// Finish a checkpoint whose write is over. If it worked, only the records
+// logged since the copy are still needed: they move to the front of the
+// journal in the new generation, to be written as usual. If it failed, the
+// old generation stays, its chunks are dirty again, and the committer
+// tries again after JOURNAL_CHECKPOINT_SECS. Caller holds g_table_lock and
+// g_journal_io.
+static void checkpoint_end_locked(void) {
+    g_ckpt.busy = 0;
+    g_last_checkpoint = time(NULL);
+    if (g_ckpt.failed) {
+        for (uint32_t i = 0; i < g_ckpt.nchunks; i++) {
+            table_mark_dirty(g_ckpt.chunks[i] * TABLE_CHUNK);
+        }
+        fs_log(LOG_ERROR, "checkpoint failed; retrying in %d s", JOURNAL_CHECKPOINT_SECS);
+    } else {
+        g_super.table_high = g_ckpt.super.table_high;
+        g_super.journal_gen = g_ckpt.super.journal_gen;
+        uint32_t from = g_ckpt.next, n = g_journal_next - from;
+        for (uint32_t i = 0; i < n; i++) {
+            JournalRecord *rec = &g_journal_buf[i];
+            *rec = g_journal_buf[from + i];
+            rec->gen = g_super.journal_gen;
+            rec->seq = i;
+            rec->checksum = fs_checksum(rec, offsetof(JournalRecord, checksum));
+        }
+        g_journal_next = n;
+        g_journal_claimed = 0;
+        g_journal_written = 0;
+        if (n == 0) {
+            g_journal_frees = 0;  // the freeing records are in the table now
+        }
+    }
+    // After a failure the device may hold either superblock, so put back
+    // the one for the generation the journal is still in; after a grow,
+    // the new size has to get there too.
+    if ((g_ckpt.failed || g_ckpt.grew) && fs_dev_write(&g_super, sizeof(g_super), 0) < 0) {
+        fs_log(LOG_ERROR, "superblock write failed blocks=%u", g_super.block_count);
+    }
+}
+
+// Write the records logged since the last call with one write, after any
+// batch the committer has in flight. If any of them free blocks, they are
+// flushed as well, so block_alloc can hand those blocks out again; that
+// flush also covers a batch whose own flush failed. Returns 0, or -EIO if
+// the flush failed. Caller holds g_table_lock.
+static int journal_write_locked(void) {
+    pthread_mutex_lock(&g_journal_io);
+    if (g_ckpt.busy) {
+        checkpoint_end_locked();  // its write is over, since we have g_journal_io
+    }
+    uint32_t n = g_journal_next - g_journal_claimed;
+    if (n > 0 && fs_dev_write(&g_journal_buf[g_journal_claimed], (size_t)n * sizeof(JournalRecord),
+                              JOURNAL_OFFSET + (off_t)g_journal_claimed * sizeof(JournalRecord)) < 0) {
+        fatal("Failed to append journal records");
+    }
+    g_journal_claimed = g_journal_written = g_journal_next;
+    int err = 0;
+    if (g_journal_frees && fs_dev_sync() != 0) {
+        fs_log(LOG_ERROR, "journal flush failed before block reuse");
+        err = -EIO;
+    } else {
+        g_journal_frees = 0;
+    }
+    pthread_mutex_unlock(&g_journal_io);
+    return err;
+}
+
+static void journal_write(void) {
+    pthread_mutex_lock(&g_table_lock);
+    journal_write_locked();
+    pthread_mutex_unlock(&g_table_lock);
+}
+
+// Whether the committer should checkpoint: the journal is half full, or
+// its oldest record is JOURNAL_CHECKPOINT_SECS old. Caller holds
+// g_table_lock.
+static int journal_checkpoint_due(void) {
+    return !g_ckpt.busy && g_journal_next > 0 &&
+           (g_journal_next >= JOURNAL_CHECKPOINT_AT ||
+            time(NULL) - g_last_checkpoint >= JOURNAL_CHECKPOINT_SECS);
+}
+
+// Checkpoint from the committer, so no callback waits for the table write
+// and its two flushes. Only the copy is made under g_table_lock, which
+// the caller holds; the I/O runs with g_journal_io alone, as a batch does.
+static void journal_checkpoint(void) {
+    if (checkpoint_begin() < 0) {
+        g_last_checkpoint = time(NULL);  // try again later
+        return;
+    }
+    pthread_mutex_lock(&g_journal_io);
+    pthread_mutex_unlock(&g_table_lock);
+    g_ckpt.failed = checkpoint_write() < 0;
+    pthread_mutex_unlock(&g_journal_io);
+
+    pthread_mutex_lock(&g_table_lock);
+    pthread_mutex_lock(&g_journal_io);
+    if (g_ckpt.busy) {
+        checkpoint_end_locked();  // unless a writer got here first
+    }
+    pthread_mutex_unlock(&g_journal_io);
+}
+
+// Writes each batch once its first record is JOURNAL_BATCH_MS old, or
+// JOURNAL_BATCH records have piled up, and flushes it to the device. The
+// batch is copied and claimed under g_table_lock, so its records are no
+// longer rewritten in place, then written and flushed with only
+// g_journal_io held: logging carries on meanwhile, and a checkpoint waits
+// for the batch before it reuses the journal. Timed and half-full
+// checkpoints run here too.
+static void *journal_committer(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&g_table_lock);
+    while (g_committer_running) {
+        if (journal_checkpoint_due()) {
+            journal_checkpoint();
+            continue;
+        }
+        if (g_journal_next == g_journal_claimed) {
+            pthread_cond_wait(&g_journal_cond, &g_table_lock);
+            continue;
+        }
+        if (g_journal_next - g_journal_claimed < JOURNAL_BATCH) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += JOURNAL_BATCH_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&g_journal_cond, &g_table_lock, &ts);
+        }
+        uint32_t from = g_journal_claimed, to = g_journal_next;
+        if (from == to) {
+            continue;  // written by someone else while we slept
+        }
+        uint32_t gen = g_super.journal_gen;
+        memcpy(g_journal_out, &g_journal_buf[from], (size_t)(to - from) * sizeof(JournalRecord));
+        g_journal_claimed = to;
+        pthread_mutex_lock(&g_journal_io);
+        pthread_mutex_unlock(&g_table_lock);
+
+        if (fs_dev_write(g_journal_out, (size_t)(to - from) * sizeof(JournalRecord),
+                         JOURNAL_OFFSET + (off_t)from * sizeof(JournalRecord)) < 0) {
+            fatal("Failed to append journal records");
+        }
+        int err = fs_dev_sync();
+        pthread_mutex_unlock(&g_journal_io);
+
+        pthread_mutex_lock(&g_table_lock);
+        if (err < 0) {
+            fs_log(LOG_ERROR, "journal flush failed records=%u", to - from);
+        } else if (g_super.journal_gen == gen && g_journal_written < to) {
+            g_journal_written = to;
+            if (g_journal_next == to) {
+                g_journal_frees = 0;  // nothing newer could have freed blocks
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_table_lock);
+    return NULL;
+}
+
+// Started from my_init like the cache flusher. Until then (and after
+// stopping it) records are written as they are logged.
+static void journal_start_committer(void) {
+    if (g_fs_fd < 0) return;
+
+    g_committer_running = 1;
+    if (pthread_create(&g_committer, NULL, journal_committer, NULL) != 0) {
+        fatal("Failed to start journal committer");
+    }
+}
+
+static void journal_stop_committer(void) {
+    if (!g_committer_running) return;
+
+    pthread_mutex_lock(&g_table_lock);
+    g_committer_running = 0;
+    pthread_cond_broadcast(&g_journal_cond);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_join(g_committer, NULL);
+    journal_write();
+}
+
+// Record the new contents of one file table slot. The in-memory table
+// stays the authoritative copy; the journal only has to survive until the
+// next checkpoint, which runs once it fills up or its oldest record gets stale.
+// Records are staged in g_journal_buf and written in order by the
+// committer, so a burst of changes costs one write. A slot logged again
+// while its record is still the last one waiting just rewrites it: a
+// create and the writes that follow it end up as one record. Caller holds
+// g_table_lock.
+static void fs_journal_log(int idx) {
+    snap_publish(idx);
+    if (g_fs_fd < 0) return;
+
+    table_mark_dirty(idx);
+    if (g_journal_next >= JOURNAL_RECORDS && g_ckpt.busy) {
+        // Full while the committer checkpoints: its write frees the
+        // records it covers, so wait for that rather than start another.
+        pthread_mutex_lock(&g_journal_io);
+        if (g_ckpt.busy) {
+            checkpoint_end_locked();
+        }
+        pthread_mutex_unlock(&g_journal_io);
+    }
+    if (g_journal_next >= JOURNAL_RECORDS ||
+        (!g_committer_running && time(NULL) - g_last_checkpoint >= JOURNAL_CHECKPOINT_SECS)) {
+        if (fs_checkpoint() == 0) {
+            g_blocks_freed = 0;
+            return;  // the table already contains this change
+        }
+        if (g_journal_next >= JOURNAL_RECORDS) {
+            return;  // no room; the slot stays dirty for the next checkpoint
+        }
+    }
+
+    // Records a busy checkpoint covers are dropped when it ends, so a
+    // change must not be folded into one of them.
+    uint32_t keep = g_journal_claimed;
+    if (g_ckpt.busy && g_ckpt.next > keep) {
+        keep = g_ckpt.next;
+    }
+    uint32_t seq = g_journal_next;
+    if (seq > keep && g_journal_buf[seq - 1].idx == (uint32_t)idx) {
+        seq--;
+    }
+    JournalRecord *rec = &g_journal_buf[seq];
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = JOURNAL_MAGIC;
+    rec->gen   = g_super.journal_gen;
+    rec->seq   = seq;
+    rec->idx   = idx;
+    entry_pack(idx, &rec->entry);
+    rec->checksum = fs_checksum(rec, offsetof(JournalRecord, checksum));
+
+    if (seq == g_journal_next) {
+        g_journal_next++;
+    }
+    g_journal_frees |= g_blocks_freed;
+    g_blocks_freed = 0;
+    if (!g_committer_running) {
+        journal_write_locked();
+    } else if (g_journal_next - g_journal_claimed == 1 ||
+               g_journal_next - g_journal_claimed == JOURNAL_BATCH ||
+               journal_checkpoint_due()) {
+        pthread_cond_signal(&g_journal_cond);
+    }
+}
+
+// Allocate the in-memory tables once g_super.max_files is known.
+static void fs_alloc_tables(void) {
+    uint32_t n = g_super.max_files;
+
+    g_meta       = xcalloc(n, sizeof(FileMeta));
+    g_names      = xcalloc(n, NAME_MAX_LEN);
+    g_body       = xcalloc(n, sizeof(FileBody));
+    g_overflow   = xcalloc(n, sizeof(*g_overflow));
+    g_slot_bitmap = xcalloc((n + 63) / 64, sizeof(uint64_t));
+    g_file_locks = xcalloc(n, sizeof(pthread_rwlock_t));
+    for (uint32_t i = 0; i < n; i++) {
+        pthread_rwlock_init(&g_file_locks[i], NULL);
+    }
+
+    g_index_size = 1;
+    while (g_index_size < 2 * n) {
+        g_index_size <<= 1;
+    }
+    g_name_index = xcalloc(g_index_size, sizeof(int32_t));
+    g_snaps = xcalloc(n, sizeof(EntrySnap));
+    g_dirs = xcalloc(n + 1, sizeof(DirIndex));
+
+    g_table_dirty = xcalloc((n + TABLE_CHUNK - 1) / TABLE_CHUNK / 8 + 1, 1);
+    g_table_buf = xcalloc(TABLE_BATCH, sizeof(FileEntry));
+    g_journal_buf = xcalloc(JOURNAL_RECORDS, sizeof(JournalRecord));
+    g_journal_out = xcalloc(JOURNAL_RECORDS, sizeof(JournalRecord));
+
+    g_chunk_map = xcalloc(g_super.map_chunks + 1, 1);
+    g_chunk_pins = xcalloc(g_super.map_chunks + 1, 1);
+    g_map_dirty = xcalloc((g_super.map_chunks / BLOCK_SIZE + 1) / 8 + 1, 1);
+}
+
+// Apply every record of the current generation on top of the loaded table,
+// then checkpoint so the journal starts out empty. Runs before anything is
+// derived from the table: an entry the journal supersedes may still point
+// at an overflow block that has been freed and reused for data since.
+static void fs_journal_replay(void) {
+    uint32_t replayed = 0;
+    JournalRecord rec;
+    for (uint32_t i = 0; i < JOURNAL_RECORDS; i++) {
+        if (fs_dev_read(&rec, sizeof(rec), JOURNAL_OFFSET + i * sizeof(rec)) != sizeof(rec)) {
+            break;
+        }
+        if (rec.magic != JOURNAL_MAGIC || rec.gen != g_super.journal_gen ||
+            rec.seq != i || rec.idx >= g_super.max_files ||
+            rec.checksum != fs_checksum(&rec, offsetof(JournalRecord, checksum))) {
+            break;  // end of the log (or a torn last record)
+        }
+        entry_unpack(rec.idx, &rec.entry);
+        table_mark_dirty(rec.idx);
+        if (rec.idx >= g_table_high) {
+            g_table_high = rec.idx + 1;  // allocated since the checkpoint
+        }
+        replayed++;
+    }
+
+    g_last_checkpoint = time(NULL);
+    if (replayed == 0) {
+        return;
+    }
+
+    printf("Replayed %u journal records\n", replayed);
+    g_super.file_count = 0;
+    for (uint32_t i = 0; i < g_table_high; i++) {
+        if (g_meta[i].used) {
+            g_super.file_count++;
+        }
+    }
+    if (fs_checkpoint() < 0) {
+        fatal("Failed to checkpoint the replayed journal");
+    }
+}
+
+// Superblock already loaded and checked. Only the slots below its
+// table_high are read: the rest of the table is free, so mount time
+// follows the number of files rather than the size of the table. The
+// journal is only looked at if the last mount did not end in an orderly
+// unmount.
+static void fs_load_metadata(void) {
+    if (g_super.table_high > g_super.max_files) {
+        fatal("Corrupt superblock: table_high is past the file table");
+    }
+    fs_alloc_tables();
+    g_table_high = g_super.table_high;
+    for (uint32_t first = 0; first < g_table_high; first += TABLE_BATCH) {
+        uint32_t n = g_table_high - first;
+        if (n > TABLE_BATCH) {
+            n = TABLE_BATCH;
+        }
+        size_t len = (size_t)n * sizeof(FileEntry);
+        if (fs_dev_read(g_table_buf, len, sizeof(g_super) + (off_t)first * sizeof(FileEntry)) !=
+            (ssize_t)len) {
+            fatal("Failed to read file table");
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            entry_unpack(first + i, &g_table_buf[i]);
+        }
+    }
+    if (fs_dev_read(g_chunk_map, g_super.map_chunks, CHUNK_MAP_OFFSET) !=
+        (ssize_t)g_super.map_chunks) {
+        fatal("Failed to read chunk map");
+    }
+    if (g_super.clean) {
+        g_last_checkpoint = time(NULL);
+    } else {
+        printf("Filesystem was not unmounted cleanly; checking the journal\n");
+        fs_journal_replay();
+    }
+    dir_index_rebuild();
+    name_index_rebuild();
+    snap_publish_all();
+    fs_rebuild_allocator();
+}
+
+// Lay out a new volume from the size/max_size/max_files options (-o mkfs);
+// without max_size the volume stays at its initial size. The image
+// is created sparse: only the superblock and file table are written, and
+// the data region stays a hole until blocks are actually used.
+static void fs_format(void) {
+    uint64_t size = g_opts.size ? parse_size(g_opts.size) : FS_DEFAULT_SIZE;
+    uint64_t max_size = g_opts.max_size ? parse_size(g_opts.max_size) : 0;
+    if (size == 0 || (g_opts.max_size && max_size == 0)) {
+        fatal("Invalid size= or max_size= option");
+    }
+    if (size / BLOCK_SIZE > UINT32_MAX || max_size / BLOCK_SIZE > UINT32_MAX) {
+        fatal("Volume size exceeds the 16 TB block address limit");
+    }
+
+    memset(&g_super, 0, sizeof(g_super));
+    g_super.magic       = FS_MAGIC;
+    g_super.version     = FS_VERSION;
+    g_super.block_size  = BLOCK_SIZE;
+    g_super.block_count = size / BLOCK_SIZE;
+    g_super.max_blocks  = max_size / BLOCK_SIZE;
+    g_super.max_files   = g_opts.max_files ? g_opts.max_files : size / BYTES_PER_FILE;
+    if (g_super.max_files < MIN_FILES) {
+        g_super.max_files = MIN_FILES;
+    }
+    if (g_super.max_blocks < g_super.block_count) {
+        g_super.max_blocks = g_super.block_count;  // no online growth
+    }
+    g_super.map_chunks  = (g_super.max_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+    g_super.data_start  = (DATA_OFFSET + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    g_super.last_alloc  = (uint64_t)g_super.data_start * BLOCK_SIZE;  // nothing used except metadata
+    g_super.file_count  = 0;
+    g_super.journal_gen = 0;
+
+    if (g_super.data_start >= g_super.block_count) {
+        fatal("Volume too small for its file table and journal");
+    }
+
+    // Create or overwrite the backing file
+    g_fs_fd = open(FS_FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (g_fs_fd < 0) {
+        fatal("Failed to create filesystem file");
+    }
+    g_dev_bytes = (uint64_t)g_super.block_count * BLOCK_SIZE;
+    if (ftruncate(g_fs_fd, g_dev_bytes) != 0) {
+        fatal("ftruncate failed when sizing filesystem file");
+    }
+    fs_map_store();
+
+    // Initialize metadata
+    fs_alloc_tables();
+    memset(g_table_dirty, 0xFF, (g_super.max_files + TABLE_CHUNK - 1) / TABLE_CHUNK / 8 + 1);
+
+    dir_index_rebuild();
+    name_index_rebuild();
+    snap_publish_all();
+    fs_rebuild_allocator();
+    if (fs_checkpoint() < 0) {
+        fatal("Failed to write the new file table");
+    }
+}
+
+// Record in the superblock whether the image is mounted. The flag is only
+// set once everything before it is on the device, and cleared (and
+// flushed) before the first change can reach the journal, so a set flag
+// always means the table is complete and replay can be skipped.
+static void fs_mark_clean(int clean) {
+    if (g_fs_fd < 0) return;
+
+    if (clean && fs_dev_sync() != 0) {
+        return;  // leave the flag clear: the next mount replays
+    }
+    g_super.clean = clean;
+    if (fs_dev_write(&g_super, sizeof(g_super), 0) < 0) {
+        fatal("Failed to write superblock");
+    }
+    if (fs_dev_sync() != 0) {
+        fatal("Failed to flush superblock");
+    }
+}
+
+// An existing image is never replaced implicitly: a missing or foreign
+// filesys.db is an error unless -o mkfs asks for a new one.
+static void fs_init(void) {
+    name_eq_init();
+    if (g_opts.mkfs) {
+        printf("Creating new filesystem...\n");
+        fs_format();
+        fs_mark_clean(0);
+        return;
+    }
+
+    g_fs_fd = open(FS_FILENAME, O_RDWR);
+    if (g_fs_fd < 0) {
+        fatal("Filesystem not found; create one with -o mkfs");
+    }
+    if (fs_dev_read(&g_super, sizeof(g_super), 0) != sizeof(g_super) ||
+        g_super.magic != FS_MAGIC) {
+        fatal("Not a filesystem image (magic mismatch); use -o mkfs to reformat");
+    }
+    if (g_super.version != FS_VERSION) {
+        fatal("Unsupported filesystem version; use -o mkfs to reformat");
+    }
+
+    if (g_super.block_size != BLOCK_SIZE) {
+        fatal("Unsupported filesystem block size");
+    }
+    if (g_opts.size || g_opts.max_files) {
+        printf("size= and max_files= only apply with -o mkfs; ignored\n");
+    }
+    if (g_opts.max_size) {
+        uint64_t max_size = parse_size(g_opts.max_size);
+        if (max_size == 0 || max_size / BLOCK_SIZE > UINT32_MAX) {
+            fatal("Invalid max_size= option");
+        }
+        g_super.max_blocks = max_size / BLOCK_SIZE;
+    }
+
+    // Growth rewrites the superblock right away, but the image only ever
+    // grows, so a bigger file means a crash landed in between.
+    struct stat st;
+    if (fstat(g_fs_fd, &st) != 0) {
+        fatal("fstat failed");
+    }
+    if ((uint64_t)st.st_size < (uint64_t)g_super.block_count * BLOCK_SIZE) {
+        fatal("Filesystem file is shorter than its superblock says");
+    }
+    g_super.block_count = st.st_size / BLOCK_SIZE;
+    if (g_super.max_blocks < g_super.block_count) {
+        g_super.max_blocks = g_super.block_count;
+    }
+    g_dev_bytes = (uint64_t)g_super.block_count * BLOCK_SIZE;
+
+    // Load metadata
+    fs_map_store();
+    fs_load_metadata();
+    fs_mark_clean(0);
+}
+
+// ---------- File table helpers ----------
+
+// Returns the slot path names, or -1 (also for the root, which has none).
+// Caller holds g_table_lock.
+static int find_file_by_name(const char *path) {
+    uint32_t dir;
+    const char *leaf;
+    if (path_parent(path, &dir, &leaf) < 0) {
+        return -1;
+    }
+    return name_index_lookup(dir, leaf, strlen(leaf));
+}
+
+// Returns the directory path names (ROOT_DIR for "/"), or a negative errno.
+// Caller holds g_table_lock.
+static int find_dir_by_name(const char *path) {
+    if (strcmp(path, "/") == 0) {
+        return ROOT_DIR;
+    }
+    int idx = find_file_by_name(path);
+    if (idx < 0) {
+        return -ENOENT;
+    }
+    return is_dir(idx) ? idx + 1 : -ENOTDIR;
+}
+
+// Returns the lowest free slot with its lock held exclusively, so a stale
+// handle to a previous occupant can't observe the slot half-initialised.
+// A trylock is enough (and keeps the lock order intact): nobody should be
+// holding a free slot. Caller holds g_table_lock.
+static int alloc_file_slot(void) {
+    int skipped = 0;
+    for (uint32_t w = g_slot_hint / 64; w * 64 < g_super.max_files; w++) {
+        uint64_t free_bits = ~g_slot_bitmap[w];
+        while (free_bits) {
+            uint32_t i = w * 64 + __builtin_ctzll(free_bits);
+            if (i >= g_super.max_files) {
+                return -1;
+            }
+            if (pthread_rwlock_trywrlock(&g_file_locks[i]) == 0) {
+                if (!skipped) {
+                    g_slot_hint = i;
+                }
+                return i;
+            }
+            skipped = 1;
+            free_bits &= free_bits - 1;
+        }
+    }
+    return -1; // no space
+}
+
+// Look up a file and take its slot lock, shared or exclusive. The name is
+// checked again once the lock is held, because the slot can be unlinked
+// (and even re-used) between the lookup and acquiring it.
+static int lock_file_by_name(const char *path, int exclusive) {
+    for (;;) {
+        pthread_mutex_lock(&g_table_lock);
+        int idx = find_file_by_name(path);
+        pthread_mutex_unlock(&g_table_lock);
+        if (idx < 0) {
+            return -ENOENT;
+        }
+
+        if (exclusive) {
+            pthread_rwlock_wrlock(&g_file_locks[idx]);
+        } else {
+            pthread_rwlock_rdlock(&g_file_locks[idx]);
+        }
+
+        pthread_mutex_lock(&g_table_lock);
+        int again = find_file_by_name(path);
+        pthread_mutex_unlock(&g_table_lock);
+        if (again == idx) {
+            return idx;
+        }
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+    }
+}
+
+// Fill in a new entry in a free slot. Caller holds g_table_lock.
+static void init_file_slot(int idx, uint32_t dir, const char *filename,
+                           uint32_t perms) {
+    table_seq_begin();
+    entry_clear(idx);
+    g_meta[idx].used = 1;
+    slot_mark(idx, 1);
+    strncpy(g_names[idx], filename, NAME_MAX_LEN - 1);
+    g_meta[idx].parent = dir;
+    g_meta[idx].perms = perms;
+    g_meta[idx].mtime = time(NULL);
+    if (!S_ISDIR(perms) && !g_opts.no_inline) {
+        g_meta[idx].flags = FE_INLINE;
+    }
+    name_index_insert(idx);
+    dir_index_insert(dir, idx);
+
+    g_super.file_count++;
+    fs_journal_log(idx);
+    table_seq_end();
+}
+
+static void fill_stat(uint32_t perms, uint64_t size, uint32_t mtime, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    if (S_ISDIR(perms)) {
+        stbuf->st_mode = S_IFDIR | (perms & 07777);
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+    }
+    stbuf->st_size = size;
+    stbuf->st_mtime = mtime;
+    stbuf->st_atime = mtime;
+    stbuf->st_ctime = mtime;
+}
+
+// Attributes of the entry in slot idx. Caller holds g_table_lock or the
+// slot lock.
+static void entry_stat(int idx, struct stat *stbuf) {
+    FileMeta *fm = &g_meta[idx];
+    fill_stat(fm->perms, fm->size, fm->mtime, stbuf);
+}
+
+// Drop a locked entry from its directory and free its blocks. Caller holds
+// the slot lock exclusively and g_table_lock.
+static void remove_file_slot(int idx) {
+    FileMeta *fm = &g_meta[idx];
+
+    table_seq_begin();
+    name_index_remove(idx);
+    dir_index_remove(fm->parent, idx);
+    if (is_dir(idx)) {
+        free(g_dirs[idx + 1].child);
+        memset(&g_dirs[idx + 1], 0, sizeof(DirIndex));
+    }
+    file_free_from(idx, 0);
+    entry_clear(idx);  // mark unused
+    slot_mark(idx, 0);
+    g_super.file_count--;
+
+    fs_journal_log(idx);
+    table_seq_end();
+}
+
+// Fill dst with size bytes of a file from offset: zeros for holes, cached
+// blocks copied right away (misses read into the cache first under the
+// chunk layer) and the rest of the image copied from the mapping or, with
+// the fd, queued as runs in runs/iov for the caller to submit. *cursor is
+// the extent hint for file_map_at. Returns the number of runs or -EIO.
+// Caller holds the slot lock, and g_cache_lock if the cache is on.
+static ssize_t file_read_plan(int idx, size_t size, off_t offset, uint8_t *dst,
+                              IoRun *runs, struct iovec *iov, uint32_t *cursor) {
+    size_t done = 0;
+    uint32_t nruns = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        uint32_t pblk;
+        uint64_t run = file_map_at(idx, pos / BLOCK_SIZE, &pblk, cursor);
+        size_t chunk = (pos / BLOCK_SIZE + run) * BLOCK_SIZE - pos;
+        size_t to_boundary = BLOCK_SIZE - pos % BLOCK_SIZE;
+        if ((pblk == 0 || g_cache_size) && chunk > to_boundary) {
+            chunk = to_boundary;  // one block at a time
+        }
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        off_t dev = (off_t)pblk * BLOCK_SIZE + pos % BLOCK_SIZE;
+        uint32_t ci = pblk && g_cache_size ? cache_lookup(pblk) : CACHE_NONE;
+        if (ci != CACHE_NONE && (g_cache[ci].io & CACHE_IO_FILL)) {
+            ci = CACHE_NONE;  // the image has what is being read in
+        }
+        if (pblk && g_cache_size) {
+            stats_add(ci != CACHE_NONE ? &stats_shard()->cache_hits
+                                       : &stats_shard()->cache_misses, 1);
+        }
+        if (pblk && g_chunked && ci == CACHE_NONE &&
+            (ci = cache_fill(pblk, 0)) == CACHE_NONE) {
+            return -EIO;
+        }
+
+        uint8_t *out = dst + done;
+        struct iovec *prev = nruns ? &iov[nruns - 1] : NULL;
+        if (ci != CACHE_NONE) {
+            memcpy(out, g_cache_data + (size_t)ci * BLOCK_SIZE + pos % BLOCK_SIZE, chunk);
+            g_cache[ci].ref = 1;
+        } else if (pblk == 0) {
+            memset(out, 0, chunk);
+        } else if (g_fs_map) {
+            memcpy(out, g_fs_map + dev, chunk);
+        } else if (prev && (uint8_t *)prev->iov_base + prev->iov_len == out &&
+                   runs[nruns - 1].off + (off_t)prev->iov_len == dev) {
+            prev->iov_len += chunk;
+        } else {
+            iov[nruns] = (struct iovec){ out, chunk };
+            runs[nruns] = (IoRun){ &iov[nruns], 1, dev, 0 };
+            nruns++;
+        }
+        done += chunk;
+    }
+    return nruns;
+}
+
+// Copy len bytes from src to the image at dev. If the blocks are fresh,
+// the parts of the first and last block outside the write are zeroed.
+static ssize_t file_write_direct(struct fuse_bufvec *src, size_t len,
+                                 off_t dev, int fresh) {
+    if (fresh) {
+        size_t head = dev % BLOCK_SIZE;
+        size_t tail = (dev + len) % BLOCK_SIZE;
+        if (head && fs_dev_write(g_zero_block, head, dev - head) < 0) {
+            return -EIO;
+        }
+        if (tail && fs_dev_write(g_zero_block, BLOCK_SIZE - tail,
+                                 dev + len) < 0) {
+            return -EIO;
+        }
+    }
+
+    // fuse_buf_copy advances src, so each piece picks up where the
+    // previous one stopped.
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    fs_dev_buf(&dst.buf[0], len, dev);
+    return fuse_buf_copy(&dst, src, 0);
+}
+
+// The same with the block cache on: partial blocks go into the cache,
+// whole ones straight to the image, unless the chunk layer needs to see
+// them. A block written whole is never read in first.
+static ssize_t file_write_cached(int idx, struct fuse_bufvec *src, size_t len,
+                                 off_t dev, int fresh) {
+    size_t done = 0;
+    while (done < len) {
+        off_t pos = dev + done;
+        uint32_t pblk = pos / BLOCK_SIZE;
+        size_t in = pos % BLOCK_SIZE;
+        size_t n = len - done;
+        ssize_t w;
+
+        if (in == 0 && n >= BLOCK_SIZE && !g_chunked) {
+            n -= n % BLOCK_SIZE;
+            cache_drop(pblk, n / BLOCK_SIZE);
+            w = file_write_direct(src, n, pos, 0);
+        } else {
+            if (n > BLOCK_SIZE - in) {
+                n = BLOCK_SIZE - in;
+            }
+            w = cache_write(pblk, idx, fresh || n == BLOCK_SIZE, src, in, n);
+        }
+        if (w < 0) {
+            return done > 0 ? (ssize_t)done : w;
+        }
+        done += w;
+        if ((size_t)w < n) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Store a write that ends within INLINE_MAX in the entry itself. The
+// bytes are staged first, since src may be a pipe, so g_table_lock is only
+// held for the copy.
+static ssize_t file_write_inline(int idx, struct fuse_bufvec *src, size_t size,
+                                 off_t offset) {
+    uint8_t buf[INLINE_MAX];
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = buf;
+    ssize_t n = fuse_buf_copy(&dst, src, 0);
+    if (n <= 0) {
+        return n < 0 ? -EIO : 0;
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    memcpy(g_body[idx].data + offset, buf, n);
+    pthread_mutex_unlock(&g_table_lock);
+    return n;
+}
+
+static ssize_t file_write_data(int idx, struct fuse_bufvec *src, size_t size,
+                               off_t offset);
+
+// Move an inline file's contents out to a block, so it can grow past
+// INLINE_MAX. Caller holds the slot lock exclusively.
+static int file_spill_inline(int idx) {
+    FileMeta *fm = &g_meta[idx];
+    uint8_t buf[INLINE_MAX];
+    size_t n = fm->size;
+    memcpy(buf, g_body[idx].data, n);
+
+    pthread_mutex_lock(&g_table_lock);
+    memset(g_body[idx].data, 0, sizeof(g_body[idx].data));
+    fm->flags &= ~FE_INLINE;
+    pthread_mutex_unlock(&g_table_lock);
+
+    if (n > 0) {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(n);
+        src.buf[0].mem = buf;
+        ssize_t w = file_write_data(idx, &src, n, 0);
+        if (w != (ssize_t)n) {
+            // Put it back the way it was
+            pthread_mutex_lock(&g_table_lock);
+            file_free_from(idx, 0);
+            memcpy(g_body[idx].data, buf, n);
+            fm->flags |= FE_INLINE;
+            pthread_mutex_unlock(&g_table_lock);
+            return w < 0 ? (int)w : -ENOSPC;
+        }
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    return 0;
+}
+
+// Make logical block lblk, backed by pblk, safe to write in place. A
+// block only listed in the dedup index just leaves it. One that other
+// extents map too is replaced with a new block of the file's own, holding
+// a copy unless the write covers it whole. Returns 0 if lblk now maps a
+// private block (look it up again), the new block if it is fresh, or a
+// negative errno. Caller holds the slot lock exclusively.
+static int64_t file_unshare(int idx, uint32_t lblk, uint32_t pblk, int whole) {
+    pthread_mutex_lock(&g_table_lock);
+    if ((block_refs(pblk) & REF_SHARES) == 0) {
+        block_set_refs(pblk, 0);
+        pthread_mutex_unlock(&g_table_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&g_table_lock);
+
+    // Nobody writes a shared block, so it can be read without the lock.
+    uint8_t buf[BLOCK_SIZE];
+    if (!whole && block_read_current(pblk, buf) < 0) {
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    uint32_t nb;
+    int err = 0;
+    if ((block_refs(pblk) & REF_SHARES) == 0) {
+        block_set_refs(pblk, 0);  // the other extents went away meanwhile
+        pthread_mutex_unlock(&g_table_lock);
+        return 0;
+    }
+    if (block_alloc(pblk + 1, 1, &nb) == 0) {
+        err = -ENOSPC;
+    } else if ((err = file_free_range(idx, lblk, lblk + 1)) < 0) {
+        block_free(nb, 1);
+    } else if ((err = file_add_extent(idx, lblk, nb, 1)) < 0) {
+        // Map the shared block again; that merges, so it can't fail.
+        block_free(nb, 1);
+        file_add_extent(idx, lblk, pblk, 1);
+        block_set_refs(pblk, block_refs(pblk) + 1);
+    }
+    pthread_mutex_unlock(&g_table_lock);
+    if (err < 0) {
+        return err;
+    }
+    stats_add(&stats_shard()->cow_blocks, 1);
+    if (whole) {
+        return nb;
+    }
+
+    struct fuse_bufvec copy = FUSE_BUFVEC_INIT(BLOCK_SIZE);
+    copy.buf[0].mem = buf;
+    ssize_t w = g_cache_size ? cache_write(nb, idx, 1, &copy, 0, BLOCK_SIZE)
+                             : fs_dev_write(buf, BLOCK_SIZE, (off_t)nb * BLOCK_SIZE);
+    return w == BLOCK_SIZE ? 0 : -EIO;
+}
+
+// Copy size bytes from src to offset, allocating blocks for any holes it
+// covers. Blocks that are new get the parts outside the write zero-filled,
+// so they never expose whatever was left on the device. Returns the number
+// of bytes written (short if the device fills up part way) or a negative
+// errno. Caller holds the slot lock exclusively.
+static ssize_t file_write_blocks(int idx, struct fuse_bufvec *src, size_t size,
+                                 off_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        off_t pos = offset + done;
+        uint32_t lblk = pos / BLOCK_SIZE;
+        uint32_t pblk;
+        uint64_t run = file_map(idx, lblk, &pblk);
+        int fresh = 0;
+
+        if (pblk != 0) {
+            // Stop the run at the first block that isn't the file's alone.
+            uint32_t touched = (pos + (size - done) - 1) / BLOCK_SIZE - lblk + 1;
+            uint32_t own = block_private(pblk, run < touched ? run : touched);
+            if (own == 0) {
+                int64_t nb = file_unshare(idx, lblk, pblk,
+                                          pos % BLOCK_SIZE == 0 && size - done >= BLOCK_SIZE);
+                if (nb < 0) {
+                    return done > 0 ? (ssize_t)done : nb;
+                }
+                if (nb == 0) {
+                    continue;
+                }
+                pblk = nb;
+                run = 1;
+                fresh = 1;
+            } else if (own < run) {
+                run = own;
+            }
+        } else {
+            uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+            uint32_t want = last - lblk + 1;
+            if (want > run) {
+                want = run;
+            }
+            pthread_mutex_lock(&g_table_lock);
+            int got = file_alloc_run(idx, lblk, want, &pblk);
+            pthread_mutex_unlock(&g_table_lock);
+            if (got < 0) {
+                return done > 0 ? (ssize_t)done : got;
+            }
+            run = got;
+            fresh = 1;
+        }
+
+        size_t chunk = (lblk + run) * BLOCK_SIZE - pos;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        off_t dev = (off_t)pblk * BLOCK_SIZE + pos % BLOCK_SIZE;
+
+        ssize_t w = g_cache_size ? file_write_cached(idx, src, chunk, dev, fresh)
+                                 : file_write_direct(src, chunk, dev, fresh);
+        if (w < 0) {
+            return done > 0 ? (ssize_t)done : w;
+        }
+        done += w;
+        if ((size_t)w < chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+// One whole block at offset with -o dedup: share a block that already
+// holds the same bytes, or write it and list it. Returns BLOCK_SIZE, the
+// bytes written if src ran short, or a negative errno. Caller holds the
+// slot lock exclusively.
+static ssize_t file_write_dedup(int idx, struct fuse_bufvec *src, off_t offset) {
+    uint8_t buf[BLOCK_SIZE];
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(BLOCK_SIZE);
+    dst.buf[0].mem = buf;
+    ssize_t n = fuse_buf_copy(&dst, src, 0);
+    if (n < 0) {
+        return -EIO;
+    }
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(n);
+    mem.buf[0].mem = buf;
+    if (n < BLOCK_SIZE) {
+        return n > 0 ? file_write_blocks(idx, &mem, n, offset) : 0;
+    }
+
+    uint32_t lblk = offset / BLOCK_SIZE;
+    uint64_t hash = block_hash(buf);
+    uint32_t cur, hit;
+    int err = -1;
+    pthread_mutex_lock(&g_table_lock);
+    file_map(idx, lblk, &cur);
+    hit = dedup_lookup(hash, buf);
+    if (hit != 0 && hit == cur) {
+        err = 0;  // rewriting what is already there
+    } else if (hit != 0 && (err = cur ? file_free_range(idx, lblk, lblk + 1) : 0) == 0) {
+        if ((err = file_add_extent(idx, lblk, hit, 1)) == 0) {
+            block_set_refs(hit, block_refs(hit) + 1);
+        }
+    }
+    pthread_mutex_unlock(&g_table_lock);
+
+    if (err == 0) {
+        stats_add(&stats_shard()->dedup_blocks, 1);
+        return cache_clean(hit) < 0 ? -EIO : BLOCK_SIZE;
+    }
+    ssize_t w = file_write_blocks(idx, &mem, BLOCK_SIZE, offset);
+    if (w == BLOCK_SIZE) {
+        pthread_mutex_lock(&g_table_lock);
+        file_map(idx, lblk, &cur);
+        if (cur != 0 && block_refs(cur) == 0) {
+            dedup_insert(hash, cur);
+        }
+        pthread_mutex_unlock(&g_table_lock);
+    }
+    return w;
+}
+
+// file_write_blocks, after moving an inline file to blocks if the write
+// takes it past INLINE_MAX, and with -o dedup one whole block at a time.
+static ssize_t file_write_data(int idx, struct fuse_bufvec *src, size_t size,
+                               off_t offset) {
+    if (g_meta[idx].flags & FE_INLINE) {
+        if ((uint64_t)offset + size <= INLINE_MAX) {
+            return file_write_inline(idx, src, size, offset);
+        }
+        int err = file_spill_inline(idx);
+        if (err < 0) {
+            return err;
+        }
+    }
+    if (g_dedup_sets == 0) {
+        return file_write_blocks(idx, src, size, offset);
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t n = size - done;
+        ssize_t w;
+        if (pos % BLOCK_SIZE == 0 && n >= BLOCK_SIZE) {
+            n = BLOCK_SIZE;
+            w = file_write_dedup(idx, src, pos);
+        } else {
+            size_t head = BLOCK_SIZE - pos % BLOCK_SIZE;
+            n = n < head ? n : head;
+            w = file_write_blocks(idx, src, n, pos);
+        }
+        if (w < 0) {
+            return done > 0 ? (ssize_t)done : w;
+        }
+        done += w;
+        if ((size_t)w < n) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Zero len bytes at off, all within one block, if that block is allocated
+// (or anywhere, in an inline file). Holes already read as zeros. Caller
+// holds the slot lock exclusively.
+static int file_zero_partial(int idx, off_t off, size_t len) {
+    FileMeta *fm = &g_meta[idx];
+    if (fm->flags & FE_INLINE) {
+        if (off < INLINE_MAX) {
+            len = len < (size_t)(INLINE_MAX - off) ? len : (size_t)(INLINE_MAX - off);
+            pthread_mutex_lock(&g_table_lock);
+            memset(g_body[idx].data + off, 0, len);
+            pthread_mutex_unlock(&g_table_lock);
+        }
+        return 0;
+    }
+
+    uint32_t pblk;
+    file_map(idx, off / BLOCK_SIZE, &pblk);
+    if (pblk == 0 || len == 0) {
+        return 0;
+    }
+    struct fuse_bufvec zero = FUSE_BUFVEC_INIT(len);
+    zero.buf[0].mem = (void *) g_zero_block;
+    ssize_t w = file_write_data(idx, &zero, len, off);
+    return w < 0 ? (int)w : 0;
+}
+
+// ---------- Open files and readahead ----------
+//
+// fi->fh points at a FileHandle, which remembers where the last read on
+// that open file ended. Reads that keep landing there (or close to it, as
+// the kernel's own readahead may reorder them) are a stream: each one asks
+// for the blocks past what was read, keeping a window ahead that starts at
+// RA_MIN_BLOCKS and doubles on every further hit. Anything else resets it.
+// With the block cache on, the worker thread reads the window into clean
+// cache blocks as one batch, so the next reads are copies from memory.
+// Without it, the kernel is told to fetch the image pages instead.
+
+// Handles come from slabs of HANDLE_SLAB and go back on a free list, so an
+// open costs a few pointer moves rather than a malloc. Each handle's mutex
+// is set up once with its slab and survives reuse. Slabs are only freed
+// at unmount.
+static int handle_open(struct fuse_file_info *fi, int idx) {
+    pthread_mutex_lock(&g_handle_lock);
+    if (g_handle_free == NULL) {
+        HandleSlab *slab = calloc(1, sizeof(*slab));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&g_handle_lock);
+            return -ENOMEM;
+        }
+        for (int i = HANDLE_SLAB - 1; i >= 0; i--) {
+            pthread_mutex_init(&slab->handles[i].lock, NULL);
+            slab->handles[i].next_free = g_handle_free;
+            g_handle_free = &slab->handles[i];
+        }
+        slab->next = g_handle_slabs;
+        g_handle_slabs = slab;
+    }
+    FileHandle *h = g_handle_free;
+    g_handle_free = h->next_free;
+    pthread_mutex_unlock(&g_handle_lock);
+
+    h->idx = idx;
+    h->ext_cursor = 0;
+    h->next_off = 0;
+    h->ra_window = 0;
+    h->ra_next = 0;
+    h->snap = NULL;
+    h->snap_len = 0;
+    h->next_free = NULL;
+    fi->fh = (uintptr_t)h;
+    return 0;
+}
+
+static FileHandle *handle_get(const struct fuse_file_info *fi) {
+    return (FileHandle *)(uintptr_t)fi->fh;
+}
+
+static void handle_close(struct fuse_file_info *fi) {
+    FileHandle *h = handle_get(fi);
+    free(h->snap);
+    h->snap = NULL;
+    fi->fh = 0;
+
+    pthread_mutex_lock(&g_handle_lock);
+    h->next_free = g_handle_free;
+    g_handle_free = h;
+    pthread_mutex_unlock(&g_handle_lock);
+}
+
+// At unmount every handle has been released.
+static void handle_pool_free(void) {
+    while (g_handle_slabs) {
+        HandleSlab *slab = g_handle_slabs;
+        g_handle_slabs = slab->next;
+        for (int i = 0; i < HANDLE_SLAB; i++) {
+            pthread_mutex_destroy(&slab->handles[i].lock);
+        }
+        free(slab);
+    }
+    g_handle_free = NULL;
+}
+
+// Fill the cache with the allocated, uncached blocks of r. Only clean slots
+// are taken, so a prefetch never forces write-back; it just stops early.
+// The slots are hashed and marked CACHE_IO_FILL under g_cache_lock, which
+// is dropped for the read (but not with the chunk layer on: chunk_write
+// reads clean cached blocks, so they have to be there). The slot lock is
+// held throughout, so the blocks can't be freed meanwhile.
+static void readahead_fill(const RaRequest *r) {
+    pthread_rwlock_rdlock(&g_file_locks[r->idx]);
+    if (!g_meta[r->idx].used) {
+        pthread_rwlock_unlock(&g_file_locks[r->idx]);
+        return;
+    }
+
+    pthread_mutex_lock(&g_cache_lock);
+    uint32_t n = 0, nruns = 0;
+    uint32_t lblk = r->lblk, end = r->lblk + r->count;
+    while (lblk < end && n < RA_MAX_BLOCKS) {
+        uint32_t pblk;
+        uint32_t run = file_map(r->idx, lblk, &pblk);
+        if (run > end - lblk) {
+            run = end - lblk;
+        }
+        for (uint32_t k = 0; pblk && k < run && n < RA_MAX_BLOCKS; k++) {
+            if (cache_lookup(pblk + k) != CACHE_NONE) {
+                continue;
+            }
+            uint32_t i = cache_scan();
+            if (i == CACHE_NONE) {
+                end = lblk;  // all dirty
+                break;
+            }
+            if (g_chunked && chunk_compressed((pblk + k) / CHUNK_BLOCKS)) {
+                // Decompressed right away rather than batched
+                if (chunk_block_read(pblk + k, g_cache_data + (size_t)i * BLOCK_SIZE) < 0) {
+                    end = lblk;
+                    break;
+                }
+                g_cache[i].pblk = pblk + k;
+                g_cache[i].dirty = 0;
+                g_cache[i].ref = 1;
+                g_cache[i].io = 0;
+                g_cache[i].next = g_cache_hash[cache_hash(pblk + k)];
+                g_cache_hash[cache_hash(pblk + k)] = i;
+                continue;
+            }
+            g_cache[i].pblk = pblk + k;
+            g_cache[i].owner = r->idx;
+            g_cache[i].dirty = 0;
+            g_cache[i].ref = 1;
+            g_cache[i].io = CACHE_IO_FILL;
+            g_cache[i].next = g_cache_hash[cache_hash(pblk + k)];
+            g_cache_hash[cache_hash(pblk + k)] = i;
+            g_ra_slots[n] = i;
+
+            IoRun *prev = nruns ? &g_ra_runs[nruns - 1] : NULL;
+            off_t dev = (off_t)(pblk + k) * BLOCK_SIZE;
+            g_ra_iov[n].iov_base = g_cache_data + (size_t)i * BLOCK_SIZE;
+            g_ra_iov[n].iov_len = BLOCK_SIZE;
+            if (prev && prev->cnt < CACHE_IOV_MAX &&
+                prev->off + (off_t)prev->cnt * BLOCK_SIZE == dev) {
+                prev->cnt++;
+            } else {
+                g_ra_runs[nruns++] = (IoRun){ &g_ra_iov[n], 1, dev, 0 };
+            }
+            n++;
+        }
+        lblk += run;
+    }
+    if (n == 0) {
+        pthread_mutex_unlock(&g_cache_lock);
+        pthread_rwlock_unlock(&g_file_locks[r->idx]);
+        return;
+    }
+
+    int err;
+    if (g_chunked) {
+        err = fs_dev_submit(g_ra_runs, nruns);
+    } else {
+        pthread_mutex_unlock(&g_cache_lock);
+        err = fs_dev_submit(g_ra_runs, nruns);
+        pthread_mutex_lock(&g_cache_lock);
+    }
+    stats_add(&stats_shard()->ra_blocks, err < 0 ? 0 : n);
+    for (uint32_t i = 0; i < n; i++) {
+        g_cache[g_ra_slots[i]].io = 0;
+        if (err < 0) {
+            cache_unhash(g_ra_slots[i]);
+        }
+    }
+    pthread_cond_broadcast(&g_cache_io_cond);
+    pthread_mutex_unlock(&g_cache_lock);
+    pthread_rwlock_unlock(&g_file_locks[r->idx]);
+}
+
+static void *readahead_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&g_ra_lock);
+    for (;;) {
+        while (g_ra_running && g_ra_head == g_ra_tail) {
+            pthread_cond_wait(&g_ra_cond, &g_ra_lock);
+        }
+        if (!g_ra_running) {
+            break;
+        }
+        RaRequest r = g_ra_queue[g_ra_head % RA_QUEUE];
+        g_ra_head++;
+        pthread_mutex_unlock(&g_ra_lock);
+        readahead_fill(&r);
+        pthread_mutex_lock(&g_ra_lock);
+    }
+    pthread_mutex_unlock(&g_ra_lock);
+    return NULL;
+}
+
+// Like the flusher, the worker is started from my_init.
+static void readahead_start_worker(void) {
+    if (g_cache_size == 0 || g_opts.no_readahead) return;
+
+    g_ra_running = 1;
+    if (pthread_create(&g_ra_worker, NULL, readahead_worker, NULL) != 0) {
+        fatal("Failed to start readahead worker");
+    }
+}
+
+static void readahead_stop_worker(void) {
+    if (!g_ra_running) return;
+
+    pthread_mutex_lock(&g_ra_lock);
+    g_ra_running = 0;
+    pthread_cond_signal(&g_ra_cond);
+    pthread_mutex_unlock(&g_ra_lock);
+    pthread_join(g_ra_worker, NULL);
+}
+
+// Start fetching count blocks of a file from lblk. Caller holds the slot
+// lock.
+static void readahead_issue(int idx, uint32_t lblk, uint32_t count) {
+    if (g_cache_size) {
+        pthread_mutex_lock(&g_ra_lock);
+        if (g_ra_running && g_ra_tail - g_ra_head < RA_QUEUE) {
+            g_ra_queue[g_ra_tail % RA_QUEUE] = (RaRequest){ idx, lblk, count };
+            g_ra_tail++;
+            pthread_cond_signal(&g_ra_cond);
+        }
+        pthread_mutex_unlock(&g_ra_lock);
+        return;
+    }
+
+    for (uint32_t end = lblk + count; lblk < end; ) {
+        uint32_t pblk;
+        uint32_t run = file_map(idx, lblk, &pblk);
+        if (run > end - lblk) {
+            run = end - lblk;
+        }
+        if (pblk && g_fs_map) {
+            madvise(g_fs_map + (size_t)pblk * BLOCK_SIZE, (size_t)run * BLOCK_SIZE, MADV_WILLNEED);
+        } else if (pblk) {
+            posix_fadvise(g_fs_fd, (off_t)pblk * BLOCK_SIZE, (off_t)run * BLOCK_SIZE,
+                          POSIX_FADV_WILLNEED);
+        }
+        lblk += run;
+    }
+}
+
+// Account for a read of size bytes at offset through h and move the
+// readahead window. Caller holds the slot lock.
+static void readahead_note(FileHandle *h, off_t offset, size_t size) {
+    if (g_opts.no_readahead || size == 0) return;
+
+    uint32_t max = RA_MAX_BLOCKS;
+    if (g_cache_size && max > g_cache_size / 4) {
+        max = g_cache_size / 4 > RA_MIN_BLOCKS ? g_cache_size / 4 : RA_MIN_BLOCKS;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    uint64_t off = offset, end = off + size;
+    uint64_t slack = (uint64_t)h->ra_window * BLOCK_SIZE;
+    if (off == h->next_off || (h->ra_window && off + slack >= h->next_off &&
+                               off <= h->next_off + slack)) {
+        h->ra_window = h->ra_window == 0 ? RA_MIN_BLOCKS :
+                       h->ra_window * 2 > max ? max : h->ra_window * 2;
+        if (end > h->next_off) {
+            h->next_off = end;
+        }
+    } else {
+        h->ra_window = 0;
+        h->ra_next = 0;
+        h->next_off = end;
+    }
+
+    if (h->ra_window) {
+        uint64_t blocks = (g_meta[h->idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint64_t from = (h->next_off + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint64_t to = from + h->ra_window;
+        if (from < h->ra_next) {
+            from = h->ra_next;
+        }
+        if (to > blocks) {
+            to = blocks;
+        }
+        if (from < to) {
+            readahead_issue(h->idx, from, to - from);
+            h->ra_next = to;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+// ---------- FUSE Callbacks ----------
+
+static void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // Keep cached pages across opens and let the kernel answer stat() and
+    // lookups itself for a while. -o direct_io (parsed by libfuse) still
+    // bypasses the page cache entirely.
+    cfg->kernel_cache = !cfg->direct_io;
+    cfg->attr_timeout = g_opts.attr_timeout;
+    cfg->entry_timeout = g_opts.entry_timeout;
+    cfg->negative_timeout = g_opts.negative_timeout;
+
+    // Buffer writes in the page cache and send them down in large chunks.
+    // The kernel then owns size and mtime until it flushes them back via
+    // truncate/utimens.
+    if (!g_opts.no_writeback && !cfg->direct_io &&
+        (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+
+    // Let my_write_buf splice request data from /dev/fuse into the image
+    // fd. Replies are plain buffers (see my_read_buf), so nothing to splice
+    // back; in mmap mode the data would only be read() into the mapping.
+    if (!g_fs_map) {
+        conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+    }
+
+    // libfuse clamps these to what the kernel and its buffers allow.
+    conn->max_write = g_opts.max_write ? parse_size(g_opts.max_write) : MAX_WRITE;
+    conn->max_readahead = MAX_READAHEAD;
+
+    log_start();
+    io_engine_start();
+    cache_start_flusher();
+    journal_start_committer();
+    readahead_start_worker();
+    return NULL;
+}
+
+// Attributes of directory dir (ROOT_DIR or slot + 1). Caller holds
+// g_table_lock or the slot lock.
+static void dir_stat(uint32_t dir, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    if (dir == ROOT_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        entry_stat(dir - 1, stbuf);
+    }
+}
+
+static int my_getattr(const char *path, struct stat *stbuf,
+                      struct fuse_file_info *fi) {
+    (void) fi;
+
+    // Root directory
+    if (strcmp(path, "/") == 0) {
+        dir_stat(ROOT_DIR, stbuf);
+        return 0;
+    }
+    if (strcmp(path, STATS_PATH) == 0) {
+        // Size 0: the contents are generated on open and read with
+        // direct_io, so the kernel never trusts it.
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_mtime = stbuf->st_atime = stbuf->st_ctime = time(NULL);
+        return 0;
+    }
+
+    // Look for file, without the lock unless the lookup keeps racing
+    EntryAttr a;
+    int idx = snap_find(path, &a);
+    if (idx >= 0) {
+        fill_stat(a.perms, a.size, a.mtime, stbuf);
+        return 0;
+    }
+    if (idx == -1) {
+        return -ENOENT;
     }
 
-    // Look for file
-    int idx = find_file_by_name(path);
+    pthread_mutex_lock(&g_table_lock);
+    idx = find_file_by_name(path);
     if (idx < 0) {
+        pthread_mutex_unlock(&g_table_lock);
         return -ENOENT;
     }
-
-    FileEntry *fe = &g_files[idx];
-    stbuf->st_mode = S_IFREG | 0644;
-    stbuf->st_nlink = 1;
-    stbuf->st_size = fe->size;
-    stbuf->st_mtime = fe->mtime;
-    stbuf->st_atime = fe->mtime;
-    stbuf->st_ctime = fe->mtime;
+    entry_stat(idx, stbuf);
+    pthread_mutex_unlock(&g_table_lock);
 
     return 0;
 }
 
+// Offsets are stable cookies: 1 and 2 follow "." and "..", slot + 3
+// follows that slot, and /.stats comes last in the root. The children are sorted by slot, so a later call
+// resumes with a binary search for the first slot past the cookie, and
+// entries created or removed in between don't shift anything else. With
+// FUSE_READDIR_PLUS every entry carries its attributes, which saves the
+// kernel a getattr per name.
 static int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                       off_t offset, struct fuse_file_info *fi,
                       enum fuse_readdir_flags flags) {
-    (void) offset;
     (void) fi;
-    (void) flags;
 
-    // Only allow reading root directory
-    if (strcmp(path, "/") != 0) {
-        return -ENOTDIR;
+    int plus = (flags & FUSE_READDIR_PLUS) != 0;
+    enum fuse_fill_dir_flags fill = plus ? FUSE_FILL_DIR_PLUS : 0;
+    struct stat st;
+
+    pthread_mutex_lock(&g_table_lock);
+    int dir = find_dir_by_name(path);
+    if (dir < 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return dir;
     }
 
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
+    // filler returns nonzero once the buffer is full; the kernel comes
+    // back later with the last cookie it got.
+    int full = 0;
+    if (offset < 1) {
+        dir_stat(dir, &st);
+        full = filler(buf, ".", plus ? &st : NULL, 1, fill);
+    }
+    if (!full && offset < 2) {
+        dir_stat(dir == ROOT_DIR ? ROOT_DIR : g_meta[dir - 1].parent, &st);
+        full = filler(buf, "..", plus ? &st : NULL, 2, fill);
+    }
+
+    // List the directory's entries
+    DirIndex *d = &g_dirs[dir];
+    uint32_t i = offset > 2 ? dir_index_find(d, offset - 2) : 0;
+    for (; !full && i < d->count; i++) {
+        int idx = d->child[i];
+        if (plus) {
+            entry_stat(idx, &st);
+        }
+        full = filler(buf, g_names[idx], plus ? &st : NULL, idx + 3, fill);
+    }
+    pthread_mutex_unlock(&g_table_lock);
 
-    // List all files
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (g_files[i].used) {
-            filler(buf, g_files[i].name, NULL, 0, 0);
+    off_t stats_cookie = (off_t)g_super.max_files + 3;
+    if (!full && dir == ROOT_DIR && offset < stats_cookie) {
+        if (plus) {
+            my_getattr(STATS_PATH, &st, NULL);
         }
+        filler(buf, STATS_PATH + 1, plus ? &st : NULL, stats_cookie, fill);
     }
 
     return 0;
 }
 
+// A snapshot of the statistics, taken now and kept until release.
+static int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    char *snap;
+    int len = stats_render(&snap);
+    if (len < 0) {
+        return len;
+    }
+    int err = handle_open(fi, STATS_FILE);
+    if (err < 0) {
+        free(snap);
+        return err;
+    }
+    handle_get(fi)->snap = snap;
+    handle_get(fi)->snap_len = len;
+    fi->direct_io = 1;
+    return 0;
+}
+
+// Empty the existing file at path, for an open with O_TRUNC. Returns its
+// slot, looked up again since the caller dropped g_table_lock, or -errno.
+static int open_truncate(const char *path) {
+    int idx = lock_file_by_name(path, 1);
+    if (idx < 0) {
+        return idx;
+    }
+    if (is_dir(idx)) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -EISDIR;
+    }
+    pthread_mutex_lock(&g_table_lock);
+    file_free_from(idx, 0);
+    g_meta[idx].size = 0;
+    g_meta[idx].mtime = time(NULL);
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+    fs_log(LOG_DEBUG, "truncate path=%s size=0", path);
+    return idx;
+}
+
 static int my_open(const char *path, struct fuse_file_info *fi) {
-    // Skip leading '/'
-    const char *filename = path;
-    if (filename[0] == '/') {
-        filename++;
+    uint32_t dir;
+    const char *filename;
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        return stats_open(fi);
     }
 
-    int idx = find_file_by_name(path);
+    pthread_mutex_lock(&g_table_lock);
+    int err = path_parent(path, &dir, &filename);
+    if (err < 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return err;
+    }
+    int idx = name_index_lookup(dir, filename, strlen(filename));
 
     if (idx < 0) {
         // File does not exist
         if (!(fi->flags & O_CREAT)) {
+            pthread_mutex_unlock(&g_table_lock);
             return -ENOENT;
         }
 
         idx = alloc_file_slot();
         if (idx < 0) {
+            pthread_mutex_unlock(&g_table_lock);
             return -ENOSPC;
         }
 
-        g_files[idx].used = 1;
-        memset(g_files[idx].name, 0, NAME_MAX_LEN);
-        strncpy(g_files[idx].name, filename, NAME_MAX_LEN - 1);
-        g_files[idx].size  = 0;
-        g_files[idx].perms = 0644;
-        g_files[idx].mtime = time(NULL);
-        g_files[idx].start = 0;
-
-        g_super.file_count++;
-        fs_recompute_last_alloc();
-        fs_sync_metadata();
+        init_file_slot(idx, dir, filename, 0644);
+        pthread_mutex_unlock(&g_table_lock);
+        pthread_rwlock_unlock(&g_file_locks[idx]);
 
-        printf("Created new file '%s' in slot %d\n", filename, idx);
+        fs_log(LOG_DEBUG, "create name=%s slot=%d", filename, idx);
+    } else if (is_dir(idx)) {
+        pthread_mutex_unlock(&g_table_lock);
+        return -EISDIR;
     } else {
+        pthread_mutex_unlock(&g_table_lock);
+
         // Existing file
         if (fi->flags & O_TRUNC) {
-            g_files[idx].size = 0;
-            g_files[idx].mtime = time(NULL);
-            fs_recompute_last_alloc();
-            fs_sync_metadata();
-            printf("Truncated file '%s'\n", filename);
+            idx = open_truncate(path);
+            if (idx < 0) {
+                return idx;
+            }
         }
     }
 
-    // Store file index in fh for later use
-    fi->fh = idx;
+    return handle_open(fi, idx);
+}
+
+// Reply with a copy of what data holds at offset, for /.stats and inline
+// files. libfuse frees both the bufvec and the copy, separately.
+static int read_copy(struct fuse_bufvec **bufp, const void *data, size_t len,
+                     size_t size, off_t offset) {
+    size_t n = (uint64_t)offset < len ? len - offset : 0;
+    n = n < size ? n : size;
+    struct fuse_bufvec *bv = malloc(sizeof(*bv));
+    uint8_t *copy = malloc(n ? n : 1);
+    if (bv == NULL || copy == NULL) {
+        free(bv);
+        free(copy);
+        return -ENOMEM;
+    }
+    *bv = FUSE_BUFVEC_INIT(n);
+    bv->buf[0].mem = memcpy(copy, (const uint8_t *)data + (n ? offset : 0), n);
+    *bufp = bv;
     return 0;
 }
 
-static int my_read(const char *path, char *buf, size_t size, off_t offset,
-                   struct fuse_file_info *fi) {
+// Reply with one buffer holding the data. It is filled before the slot
+// lock is dropped: a buffer pointing at the image would be read by libfuse
+// after we return, when a truncate or unlink may already have freed the
+// blocks and handed them to another file. Image runs are read as one I/O
+// engine batch, without g_cache_lock.
+static int my_read_buf(const char *path, struct fuse_bufvec **bufp,
+                       size_t size, off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    int idx = (int)fi->fh;
-    if (idx < 0 || idx >= MAX_FILES || !g_files[idx].used) {
+    FileHandle *h = handle_get(fi);
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if (h->idx == STATS_FILE) {
+        return read_copy(bufp, h->snap, h->snap_len, size, offset);
+    }
+    int idx = h->idx;
+
+    pthread_rwlock_rdlock(&g_file_locks[idx]);
+    FileMeta *fm = &g_meta[idx];
+    if (!fm->used) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
         return -EBADF;
     }
+    if (fm->flags & FE_INLINE) {
+        int err = read_copy(bufp, g_body[idx].data, fm->size, size, offset);
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return err;
+    }
 
-    FileEntry *fe = &g_files[idx];
+    if ((uint64_t)offset >= fm->size) {
+        size = 0; // nothing to read
+    } else if (offset + size > fm->size) {
+        size = fm->size - offset; // clamp
+    }
 
-    if (offset >= fe->size) {
-        return 0; // nothing to read
+    // Runs end on a block boundary or at the end of the read, so this many
+    // always suffice. They live after the bufvec, which libfuse frees along
+    // with the data buffer.
+    size_t max_runs = size / BLOCK_SIZE + 2;
+    struct fuse_bufvec *bv = malloc(sizeof(*bv) + max_runs * (sizeof(IoRun) + sizeof(struct iovec)));
+    uint8_t *data = malloc(size ? size : 1);
+    if (bv == NULL || data == NULL) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        free(bv);
+        free(data);
+        return -ENOMEM;
     }
+    IoRun *runs = (IoRun *)(bv + 1);
+    struct iovec *iov = (struct iovec *)(runs + max_runs);
 
-    if (offset + size > fe->size) {
-        size = fe->size - offset; // clamp
+    if (g_cache_size) {
+        pthread_mutex_lock(&g_cache_lock);
+    }
+    // Threads sharing the handle may race on the cursor; any value works.
+    uint32_t cursor = __atomic_load_n(&h->ext_cursor, __ATOMIC_RELAXED);
+    ssize_t nruns = file_read_plan(idx, size, offset, data, runs, iov, &cursor);
+    __atomic_store_n(&h->ext_cursor, cursor, __ATOMIC_RELAXED);
+    if (g_cache_size) {
+        pthread_mutex_unlock(&g_cache_lock);
+    }
+    int err = nruns < 0 ? (int)nruns : nruns > 0 ? fs_dev_submit(runs, nruns) : 0;
+    if (err < 0) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        free(bv);
+        free(data);
+        return err;
     }
 
-    uint32_t region_start = DATA_OFFSET + idx * FILE_REGION_SIZE;
-    uint32_t file_offset = region_start + offset;
+    readahead_note(h, offset, size);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+    *bv = FUSE_BUFVEC_INIT(size);
+    bv->buf[0].mem = data;
+    *bufp = bv;
+    return 0;
+}
 
-    if (fseek(g_fs_file, file_offset, SEEK_SET) != 0) {
-        return -EIO;
+static int my_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+    struct fuse_bufvec *src;
+    int err = my_read_buf(path, &src, size, offset, fi);
+    if (err < 0) {
+        return err;
     }
 
-    size_t r = fread(buf, 1, size, g_fs_file);
-    return (int)r;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+    dst.buf[0].mem = buf;
+    ssize_t r = fuse_buf_copy(&dst, src, 0);
+    free(src->buf[0].mem);
+    free(src);
+    return r < 0 ? -EIO : (int)r;
 }
 
-static int my_write(const char *path, const char *buf, size_t size,
-                    off_t offset, struct fuse_file_info *fi) {
+// The source may be a pipe from /dev/fuse; file_write_data splices it
+// straight into each run of the image.
+static int my_write_buf(const char *path, struct fuse_bufvec *buf,
+                        off_t offset, struct fuse_file_info *fi) {
     (void) path;
 
-    int idx = (int)fi->fh;
-    if (idx < 0 || idx >= MAX_FILES || !g_files[idx].used) {
+    FileHandle *h = handle_get(fi);
+    if (h == NULL || h->idx == STATS_FILE) {
         return -EBADF;
     }
+    int idx = h->idx;
 
-    FileEntry *fe = &g_files[idx];
-
-    if (offset + size > FILE_REGION_SIZE) {
-        return -ENOSPC;
+    size_t size = fuse_buf_size(buf);
+    if (offset + size > MAX_FILE_SIZE) {
+        return -EFBIG;
     }
 
-    uint32_t region_start = DATA_OFFSET + idx * FILE_REGION_SIZE;
-    uint32_t file_offset = region_start + offset;
-
-    if (fseek(g_fs_file, file_offset, SEEK_SET) != 0) {
-        return -EIO;
+    pthread_rwlock_wrlock(&g_file_locks[idx]);
+    FileMeta *fm = &g_meta[idx];
+    if (!fm->used) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -EBADF;
     }
 
-    size_t w = fwrite(buf, 1, size, g_fs_file);
-    if (w != size) {
-        return -EIO;
+    ssize_t w = file_write_data(idx, buf, size, offset);
+    if (w <= 0) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return (int)w;
     }
 
     // Update size if we extended the file
-    uint32_t new_end = offset + size;
-    if (new_end > fe->size) {
-        fe->size = new_end;
+    pthread_mutex_lock(&g_table_lock);
+    uint64_t new_end = offset + w;
+    if (new_end > fm->size) {
+        fm->size = new_end;
     }
 
-    fe->mtime = time(NULL);
-    fs_recompute_last_alloc();
-    fs_sync_metadata();
+    fm->mtime = time(NULL);
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
 
     return (int)w;
 }
 
+static int my_write(const char *path, const char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void *) buf;
+    return my_write_buf(path, &src, offset, fi);
+}
+
 static int my_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    (void) mode;
+    uint32_t dir;
+    const char *filename;
 
-    const char *filename = path;
-    if (filename[0] == '/') {
-        filename++;
+    if (strcmp(path, STATS_PATH) == 0) {
+        return (fi->flags & O_EXCL) ? -EEXIST : stats_open(fi);
     }
 
-    int idx = find_file_by_name(path);
+    pthread_mutex_lock(&g_table_lock);
+    int err = path_parent(path, &dir, &filename);
+    if (err < 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return err;
+    }
+    int idx = name_index_lookup(dir, filename, strlen(filename));
     if (idx >= 0) {
-        // File already exists
-        fi->fh = idx;
-        return 0;
+        // File already exists: open(2) semantics for the flags
+        int dir_exists = is_dir(idx);
+        pthread_mutex_unlock(&g_table_lock);
+        if (fi->flags & O_EXCL) {
+            return -EEXIST;
+        }
+        if (dir_exists) {
+            return -EISDIR;
+        }
+        if (fi->flags & O_TRUNC) {
+            idx = open_truncate(path);
+            if (idx < 0) {
+                return idx;
+            }
+        }
+        return handle_open(fi, idx);
     }
 
     idx = alloc_file_slot();
     if (idx < 0) {
+        pthread_mutex_unlock(&g_table_lock);
         return -ENOSPC;
     }
 
-    g_files[idx].used = 1;
-    memset(g_files[idx].name, 0, NAME_MAX_LEN);
-    strncpy(g_files[idx].name, filename, NAME_MAX_LEN - 1);
-    g_files[idx].size  = 0;
-    g_files[idx].perms = mode;
-    g_files[idx].mtime = time(NULL);
-    g_files[idx].start = 0;
+    init_file_slot(idx, dir, filename, mode);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
 
-    g_super.file_count++;
-    fs_recompute_last_alloc();
-    fs_sync_metadata();
+    return handle_open(fi, idx);
+}
+
+static int my_mkdir(const char *path, mode_t mode) {
+    uint32_t dir;
+    const char *name;
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EEXIST;
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    int err = path_parent(path, &dir, &name);
+    if (err < 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return err;
+    }
+    if (name_index_lookup(dir, name, strlen(name)) >= 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return -EEXIST;
+    }
+
+    int idx = alloc_file_slot();
+    if (idx < 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        return -ENOSPC;
+    }
+
+    init_file_slot(idx, dir, name, S_IFDIR | (mode & 07777));
+    fs_log(LOG_DEBUG, "mkdir name=%s slot=%d", name, idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
 
-    fi->fh = idx;
     return 0;
 }
 
 static int my_unlink(const char *path) {
-    int idx = find_file_by_name(path);
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EPERM;
+    }
+    int idx = lock_file_by_name(path, 1);
+    if (idx < 0) {
+        return -ENOENT;
+    }
+    if (is_dir(idx)) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -EISDIR;
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    fs_log(LOG_DEBUG, "unlink name=%s slot=%d", g_names[idx], idx);
+    remove_file_slot(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+
+    return 0;
+}
+
+static int my_rmdir(const char *path) {
+    int idx = lock_file_by_name(path, 1);
     if (idx < 0) {
         return -ENOENT;
     }
+    if (!is_dir(idx)) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -ENOTDIR;
+    }
 
-    FileEntry *fe = &g_files[idx];
-    printf("Removing file '%s'\n", fe->name);
+    // New entries are only added under g_table_lock, so the check holds.
+    pthread_mutex_lock(&g_table_lock);
+    if (g_dirs[idx + 1].count > 0) {
+        pthread_mutex_unlock(&g_table_lock);
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -ENOTEMPTY;
+    }
+    fs_log(LOG_DEBUG, "rmdir name=%s slot=%d", g_names[idx], idx);
+    remove_file_slot(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
 
-    memset(fe, 0, sizeof(*fe));  // mark unused
-    g_super.file_count--;
+    return 0;
+}
+
+// Both slot locks are taken in index order so two renames can't deadlock.
+static void lock_slot_pair(int a, int b) {
+    if (b < 0 || a == b) {
+        pthread_rwlock_wrlock(&g_file_locks[a]);
+    } else {
+        pthread_rwlock_wrlock(&g_file_locks[a < b ? a : b]);
+        pthread_rwlock_wrlock(&g_file_locks[a < b ? b : a]);
+    }
+}
+
+static void unlock_slot_pair(int a, int b) {
+    pthread_rwlock_unlock(&g_file_locks[a]);
+    if (b >= 0 && b != a) {
+        pthread_rwlock_unlock(&g_file_locks[b]);
+    }
+}
+
+// Checks that make rename fail without touching anything. Caller holds
+// both slot locks and g_table_lock.
+static int rename_check(int src, int dst, uint32_t dir, unsigned int flags) {
+    if (dst >= 0 && (flags & RENAME_NOREPLACE)) {
+        return -EEXIST;
+    }
+    if (is_dir(src)) {
+        // A directory can't move underneath itself.
+        for (uint32_t d = dir; d != ROOT_DIR; d = g_meta[d - 1].parent) {
+            if (d == (uint32_t)src + 1) {
+                return -EINVAL;
+            }
+        }
+    }
+    if (dst >= 0) {
+        if (is_dir(dst) && !is_dir(src)) {
+            return -EISDIR;
+        }
+        if (!is_dir(dst) && is_dir(src)) {
+            return -ENOTDIR;
+        }
+        if (is_dir(dst) && g_dirs[dst + 1].count > 0) {
+            return -ENOTEMPTY;
+        }
+    }
+    return 0;
+}
 
-    fs_recompute_last_alloc();
-    fs_sync_metadata();
+static int my_rename(const char *from, const char *to, unsigned int flags) {
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;  // RENAME_EXCHANGE is not supported
+    }
+    if (strcmp(from, STATS_PATH) == 0 || strcmp(to, STATS_PATH) == 0) {
+        return -EPERM;
+    }
+
+    // Resolve both names, lock the slots, then make sure neither name
+    // moved in the meantime (as lock_file_by_name does for one).
+    int src, dst;
+    uint32_t dir;
+    const char *name;
+    for (;;) {
+        pthread_mutex_lock(&g_table_lock);
+        src = find_file_by_name(from);
+        int err = src < 0 ? -ENOENT : path_parent(to, &dir, &name);
+        dst = err < 0 ? -1 : name_index_lookup(dir, name, strlen(name));
+        pthread_mutex_unlock(&g_table_lock);
+        if (err < 0) {
+            return err;
+        }
+
+        lock_slot_pair(src, dst);
+        pthread_mutex_lock(&g_table_lock);
+        uint32_t dir2;
+        if (find_file_by_name(from) == src && path_parent(to, &dir2, &name) == 0 &&
+            dir2 == dir && name_index_lookup(dir, name, strlen(name)) == dst) {
+            break;
+        }
+        pthread_mutex_unlock(&g_table_lock);
+        unlock_slot_pair(src, dst);
+    }
+
+    int err = src == dst ? 0 : rename_check(src, dst, dir, flags);
+    if (err < 0 || src == dst) {
+        pthread_mutex_unlock(&g_table_lock);
+        unlock_slot_pair(src, dst);
+        return err;
+    }
+
+    if (dst >= 0) {
+        remove_file_slot(dst);
+    }
+
+    FileMeta *fm = &g_meta[src];
+    table_seq_begin();
+    name_index_remove(src);
+    dir_index_remove(fm->parent, src);
+    memset(g_names[src], 0, NAME_MAX_LEN);
+    strncpy(g_names[src], name, NAME_MAX_LEN - 1);
+    fm->parent = dir;
+    name_index_insert(src);
+    dir_index_insert(dir, src);
+    fs_journal_log(src);
+    table_seq_end();
+    fs_log(LOG_DEBUG, "rename slot=%d to=%s dir=%u replaced=%d", src, name, dir, dst);
 
+    pthread_mutex_unlock(&g_table_lock);
+    unlock_slot_pair(src, dst);
     return 0;
 }
 
 static int my_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
     (void) fi;
 
-    int idx = find_file_by_name(path);
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if ((uint64_t)size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EPERM;
+    }
+
+    int idx = lock_file_by_name(path, 1);
     if (idx < 0) {
         return -ENOENT;
     }
+    if (is_dir(idx)) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -EISDIR;
+    }
 
-    if (size > FILE_REGION_SIZE) {
-        return -ENOSPC;
+    if ((g_meta[idx].flags & FE_INLINE) && size > INLINE_MAX) {
+        int err = file_spill_inline(idx);
+        if (err < 0) {
+            pthread_rwlock_unlock(&g_file_locks[idx]);
+            return err;
+        }
     }
 
-    g_files[idx].size = size;
-    g_files[idx].mtime = time(NULL);
-    fs_recompute_last_alloc();
-    fs_sync_metadata();
+    // The rest of a partial last block must read as zeros if the file
+    // grows again, so clear what a shrink leaves behind in it.
+    if ((uint64_t)size < g_meta[idx].size && size % BLOCK_SIZE) {
+        int err = file_zero_partial(idx, size, BLOCK_SIZE - size % BLOCK_SIZE);
+        if (err < 0) {
+            pthread_rwlock_unlock(&g_file_locks[idx]);
+            return err;
+        }
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    file_free_from(idx, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    g_meta[idx].size = size;
+    g_meta[idx].mtime = time(NULL);
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
 
     return 0;
 }
 
-static int my_release(const char *path, struct fuse_file_info *fi) {
+// Give every hole in blocks [first, end) zeroed blocks of its own.
+// Caller holds the slot lock exclusively.
+static int file_preallocate(int idx, uint32_t first, uint32_t end) {
+    uint32_t lblk = first;
+    while (lblk < end) {
+        uint32_t pblk;
+        uint64_t run = file_map(idx, lblk, &pblk);
+        if (run > end - lblk) {
+            run = end - lblk;
+        }
+        if (pblk != 0) {
+            lblk += run;
+            continue;
+        }
+
+        pthread_mutex_lock(&g_table_lock);
+        int got = file_alloc_run(idx, lblk, run, &pblk);
+        pthread_mutex_unlock(&g_table_lock);
+        if (got < 0) {
+            return got;
+        }
+        // Readers are shut out by the slot lock until this is done
+        if ((g_chunked ? cache_zero(idx, pblk, got) : fs_dev_zero(pblk, got)) < 0) {
+            return -EIO;
+        }
+        lblk += got;
+    }
+    return 0;
+}
+
+// Preallocation (mode 0 or KEEP_SIZE) and PUNCH_HOLE. A punched range
+// reads as zeros: whole blocks go back to the free pool, the partial ones
+// at either end are cleared in place.
+static int my_fallocate(const char *path, int mode, off_t offset, off_t length,
+                        struct fuse_file_info *fi) {
+    (void) fi;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        return -EOPNOTSUPP;
+    }
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if ((uint64_t)offset + length > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EPERM;
+    }
+
+    int idx = lock_file_by_name(path, 1);
+    if (idx < 0) {
+        return -ENOENT;
+    }
+    if (is_dir(idx)) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return -EISDIR;
+    }
+
+    off_t end = offset + length;
+    uint32_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t last = end / BLOCK_SIZE;
+    int err = 0;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (g_meta[idx].flags & FE_INLINE) {
+            err = file_zero_partial(idx, offset, length);
+        } else if (first > last) {
+            // Inside one block
+            err = file_zero_partial(idx, offset, length);
+        } else {
+            err = file_zero_partial(idx, offset, (off_t)first * BLOCK_SIZE - offset);
+            if (err == 0) {
+                err = file_zero_partial(idx, (off_t)last * BLOCK_SIZE,
+                                        end - (off_t)last * BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_lock(&g_table_lock);
+        if (err == 0 && first < last) {
+            err = file_free_range(idx, first, last);
+        }
+        g_meta[idx].mtime = time(NULL);
+    } else {
+        // An inline file needs blocks only to go past INLINE_MAX
+        if ((g_meta[idx].flags & FE_INLINE) && end > INLINE_MAX) {
+            err = file_spill_inline(idx);
+        }
+        if (err == 0 && !(g_meta[idx].flags & FE_INLINE)) {
+            err = file_preallocate(idx, offset / BLOCK_SIZE, (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        }
+        pthread_mutex_lock(&g_table_lock);
+        if (err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && (uint64_t)end > g_meta[idx].size) {
+            g_meta[idx].size = end;
+            g_meta[idx].mtime = time(NULL);
+        }
+    }
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+
+    fs_log(LOG_DEBUG, "fallocate slot=%d mode=%d off=%lld len=%lld err=%d",
+           idx, mode, (long long)offset, (long long)length, err);
+    return err;
+}
+
+// SEEK_DATA and SEEK_HOLE, at block granularity; the kernel handles the
+// other whence values itself. There is always a hole at end of file.
+static off_t my_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+    (void) path;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    uint32_t idx = handle_get(fi)->idx;
+    if (idx == STATS_FILE) {
+        return -EINVAL;
+    }
+    if (off < 0) {
+        return -ENXIO;
+    }
+
+    pthread_rwlock_rdlock(&g_file_locks[idx]);
+    off_t size = g_meta[idx].size;
+    off_t ret = -ENXIO;
+    if (off < size && (g_meta[idx].flags & FE_INLINE)) {
+        ret = whence == SEEK_DATA ? off : size;  // all data
+    } else if (off < size) {
+        uint64_t lblk = off / BLOCK_SIZE;
+        while ((off_t)(lblk * BLOCK_SIZE) < size) {
+            uint32_t pblk;
+            uint64_t run = file_map(idx, lblk, &pblk);
+            if ((pblk != 0) == (whence == SEEK_DATA)) {
+                ret = (off_t)(lblk * BLOCK_SIZE);
+                break;
+            }
+            lblk += run;
+        }
+        if (ret >= 0 && ret < off) {
+            ret = off;
+        }
+        if (whence == SEEK_HOLE && (ret < 0 || ret > size)) {
+            ret = size;
+        }
+    }
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+    return ret;
+}
+
+// Everything here is kept up to date as blocks and slots change hands, and
+// read without g_table_lock, so monitoring that polls df never waits
+// behind (or holds up) metadata changes. The counters are loaded one at a
+// time, so while the image grows the answer can be a block count behind.
+// Space the image may still grow into counts as free.
+static int my_statfs(const char *path, struct statvfs *st) {
     (void) path;
+
+    uint64_t blocks = __atomic_load_n(&g_dev_bytes, __ATOMIC_ACQUIRE) / BLOCK_SIZE;
+    uint64_t total = g_super.max_blocks > blocks ? g_super.max_blocks : blocks;
+    uint64_t free_blocks = __atomic_load_n(&g_free_blocks, __ATOMIC_RELAXED) + (total - blocks);
+    uint32_t used_slots = __atomic_load_n(&g_used_slots, __ATOMIC_RELAXED);
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize   = BLOCK_SIZE;
+    st->f_frsize  = BLOCK_SIZE;
+    st->f_blocks  = total - g_super.data_start;
+    st->f_bfree   = free_blocks < st->f_blocks ? free_blocks : st->f_blocks;
+    st->f_bavail  = st->f_bfree;
+    st->f_files   = g_super.max_files;
+    st->f_ffree   = g_super.max_files - used_slots;
+    st->f_favail  = st->f_ffree;
+    st->f_namemax = NAME_MAX_LEN - 1;
+    return 0;
+}
+
+static int my_utimens(const char *path, const struct timespec tv[2],
+                      struct fuse_file_info *fi) {
     (void) fi;
-    // Nothing special needed on close
+
+    // The root and the stats file have no stored times to change.
+    if (strcmp(path, "/") == 0 || strcmp(path, STATS_PATH) == 0) {
+        return 0;
+    }
+
+    int idx = lock_file_by_name(path, 1);
+    if (idx < 0) {
+        return -ENOENT;
+    }
+
+    // Only mtime is stored; atime and ctime are reported as mtime.
+    if (tv != NULL && tv[1].tv_nsec == UTIME_OMIT) {
+        pthread_rwlock_unlock(&g_file_locks[idx]);
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_table_lock);
+    if (tv == NULL || tv[1].tv_nsec == UTIME_NOW) {
+        g_meta[idx].mtime = time(NULL);
+    } else {
+        g_meta[idx].mtime = tv[1].tv_sec;
+    }
+    fs_journal_log(idx);
+    pthread_mutex_unlock(&g_table_lock);
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+
     return 0;
 }
 
+static int my_release(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    // Write back what this file still has in the block cache
+    uint32_t idx = handle_get(fi)->idx;
+    int err = idx == STATS_FILE ? 0 : cache_flush(idx);
+    handle_close(fi);
+    return err;
+}
+
+// close(2) on one descriptor. Not a durability point, but write-back
+// errors for the file show up here rather than nowhere.
+static int my_flush(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    uint32_t idx = handle_get(fi)->idx;
+    return idx == STATS_FILE ? 0 : cache_flush(idx);
+}
+
+// Metadata changes are journaled as they happen, so once the file's cached
+// blocks are in the image one device flush makes both durable; fdatasync
+// needs nothing less. No checkpoint is needed: replay covers the journal.
+static int my_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    uint32_t idx = fi ? handle_get(fi)->idx : CACHE_NONE;
+    if (idx == STATS_FILE) {
+        return 0;
+    }
+    if (cache_flush(idx) < 0) {
+        return -EIO;
+    }
+    return fs_commit();
+}
+
+// Entries are journaled too, so a directory only needs the device flush.
+static int my_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    (void) fi;
+    return fs_commit();
+}
+
+static void my_destroy(void *private_data) {
+    (void) private_data;
+    readahead_stop_worker();
+    cache_stop_flusher();
+    journal_stop_committer();
+    cache_flush(CACHE_NONE);
+    if (fs_checkpoint() == 0) {
+        fs_mark_clean(1);  // otherwise the next mount replays the journal
+    }
+    fs_close_store();
+    handle_pool_free();
+    log_stop();
+}
+
+// Timed entry points for the callbacks /.stats reports on. my_read and
+// my_write call the untimed _buf versions, so each request counts once.
+static int timed_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_getattr(path, stbuf, fi);
+    stats_record(OP_GETATTR, t0, ret, 0);
+    return ret;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    uint64_t t0 = stats_now();
+    int ret = my_readdir(path, buf, filler, offset, fi, flags);
+    stats_record(OP_READDIR, t0, ret, 0);
+    return ret;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_open(path, fi);
+    stats_record(OP_OPEN, t0, ret, 0);
+    return ret;
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_create(path, mode, fi);
+    stats_record(OP_CREATE, t0, ret, 0);
+    return ret;
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                          off_t offset, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_read_buf(path, bufp, size, offset, fi);
+    stats_record(OP_READ, t0, ret, ret == 0 ? fuse_buf_size(*bufp) : 0);
+    return ret;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_read(path, buf, size, offset, fi);
+    stats_record(OP_READ, t0, ret, ret > 0 ? ret : 0);
+    return ret;
+}
+
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_write_buf(path, buf, offset, fi);
+    stats_record(OP_WRITE, t0, ret, ret > 0 ? ret : 0);
+    return ret;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_write(path, buf, size, offset, fi);
+    stats_record(OP_WRITE, t0, ret, ret > 0 ? ret : 0);
+    return ret;
+}
+
+static int timed_unlink(const char *path) {
+    uint64_t t0 = stats_now();
+    int ret = my_unlink(path);
+    stats_record(OP_UNLINK, t0, ret, 0);
+    return ret;
+}
+
+static int timed_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_truncate(path, size, fi);
+    stats_record(OP_TRUNCATE, t0, ret, 0);
+    return ret;
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int ret = my_fsync(path, datasync, fi);
+    stats_record(OP_FSYNC, t0, ret, 0);
+    return ret;
+}
+
 static struct fuse_operations my_oper = {
-    .getattr    = my_getattr,
-    .readdir    = my_readdir,
-    .open       = my_open,
-    .read       = my_read,
-    .write      = my_write,
-    .create     = my_create,
-    .unlink     = my_unlink,
-    .truncate   = my_truncate,
+    .init       = my_init,
+    .getattr    = timed_getattr,
+    .readdir    = timed_readdir,
+    .open       = timed_open,
+    .read       = timed_read,
+    .read_buf   = timed_read_buf,
+    .write      = timed_write,
+    .write_buf  = timed_write_buf,
+    .create     = timed_create,
+    .mkdir      = my_mkdir,
+    .unlink     = timed_unlink,
+    .rmdir      = my_rmdir,
+    .rename     = my_rename,
+    .truncate   = timed_truncate,
+    .utimens    = my_utimens,
+    .statfs     = my_statfs,
     .release    = my_release,
+    .flush      = my_flush,
+    .fsync      = timed_fsync,
+    .fsyncdir   = my_fsyncdir,
+    .fallocate  = my_fallocate,
+    .lseek      = my_lseek,
+    .destroy    = my_destroy,
 };
 
 // ---------- Main ----------
 
+// bench_fs.c includes this file with FS_NO_MAIN to call the callbacks
+// directly.
+#ifndef FS_NO_MAIN
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    g_opts.attr_timeout = ATTR_TIMEOUT;
+    g_opts.entry_timeout = ENTRY_TIMEOUT;
+    g_opts.negative_timeout = NEGATIVE_TIMEOUT;
+    if (fuse_opt_parse(&args, &g_opts, option_spec, NULL) == -1) {
+        return 1;
+    }
+
+    log_setup();
+    if (g_opts.max_write && parse_size(g_opts.max_write) < BLOCK_SIZE) {
+        fatal("Invalid max_write= option");
+    }
+    io_engine_select();
     fs_init();
+    cache_setup();
+    chunk_setup();
+    dedup_setup();
 
     printf("=== FUSE Filesystem Initialized ===\n");
     printf("Mounting at: %s\n", argc > 1 ? argv[1] : "/tmp/myfuse");
-    printf("Created %u files, %u bytes used\n", 
-           g_super.file_count, g_super.last_alloc);
+    printf("Created %u files, %llu bytes used\n", 
+           g_super.file_count, (unsigned long long)g_super.last_alloc);
+    printf("Volume: %llu bytes in %u blocks, %u file slots\n",
+           (unsigned long long)g_dev_bytes, g_super.block_count, g_super.max_files);
+
+    if (g_opts.use_mmap) {
+        printf("Serving I/O from a shared mapping of %s\n", FS_FILENAME);
+    }
+    if (g_cache_size) {
+        printf("Block cache: %u blocks\n", g_cache_size);
+    }
+    if (g_compress != CHUNK_RAW) {
+        printf("Compression: %s in %u KB chunks\n", g_opts.compress, CHUNK_BYTES / 1024);
+    }
+    if (g_dedup_sets) {
+        printf("Deduplication: index of %u blocks\n", g_dedup_sets * DEDUP_WAYS);
+    }
 
     // Mount the filesystem
-    return fuse_main(argc, argv, &my_oper, NULL);
+    int ret = fuse_main(args.argc, args.argv, &my_oper, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
+#endif
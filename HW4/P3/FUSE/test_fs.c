@@ -0,0 +1,835 @@
+// In-process tests for the filesystem callbacks.
+//
+// Builds main_fs.c into this program (without its main), like bench_fs,
+// and checks what the callbacks return against a model of what was
+// written. Each case runs on a fresh image in its own scratch directory,
+// and each mount of it is a child process, so a case can stop the daemon
+// uncleanly and mount again, and a crash only fails that case. Every case
+// runs once per mount option set.
+//
+//   ./test_fs [-o mount options] [case ...]
+//
+// Without -o the cases run with the default options and a few others that
+// take different paths (no cache, a tiny cache, mmap, io_uring, no inline
+// data). The exit status is the number of failed runs.
+
+#define FS_NO_MAIN
+#include "main_fs.c"
+
+#include <sys/wait.h>
+
+#define TEST_GEOMETRY "size=32M,max_files=1024"
+#define TEST_IO_SIZE  (128 * 1024)       // read size when comparing files
+
+static const char *g_default_opts[] = {
+    "", "cache_size=0", "cache_size=64K", "mmap", "io_engine=io_uring", "no_inline",
+#ifdef HAVE_LZ4
+    "compress=lz4",
+#endif
+};
+#define NDEFAULT_OPTS (sizeof(g_default_opts) / sizeof(g_default_opts[0]))
+
+static const char *g_test_opts;          // options of the current run
+static int g_failures;                   // checks failed in this process
+static int g_model_only;                 // only update the models, see below
+
+#define FAIL() __atomic_add_fetch(&g_failures, 1, __ATOMIC_RELAXED)
+#define CHECK(c) do { \
+        if (!(c)) { \
+            printf("    %s:%d: %s\n", __FILE__, __LINE__, #c); \
+            FAIL(); \
+        } \
+    } while (0)
+
+// ---------- Mounting ----------
+
+// Mount the image in the current directory, as main would, formatting it
+// first with mkfs. Options are the run's plus extra.
+static void test_mount(int mkfs, const char *extra) {
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    fuse_opt_add_arg(&args, "test_fs");
+    if (mkfs) {
+        fuse_opt_add_arg(&args, "-omkfs," TEST_GEOMETRY);
+    }
+    if (*g_test_opts) {
+        fuse_opt_add_arg(&args, "-o");
+        fuse_opt_add_arg(&args, g_test_opts);
+    }
+    if (*extra) {
+        fuse_opt_add_arg(&args, "-o");
+        fuse_opt_add_arg(&args, extra);
+    }
+    if (fuse_opt_parse(&args, &g_opts, option_spec, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    log_setup();
+    io_engine_select();
+    fs_init();
+    cache_setup();
+    chunk_setup();
+    dedup_setup();
+
+    struct fuse_conn_info conn;
+    struct fuse_config cfg;
+    memset(&conn, 0, sizeof(conn));
+    memset(&cfg, 0, sizeof(cfg));
+    my_oper.init(&conn, &cfg);
+    fuse_opt_free_args(&args);
+}
+
+// Run phase in a child process on a mount of the image in the current
+// directory, then unmount cleanly, unless the phase calls test_crash.
+// Returns the number of failed checks (1 if the child died).
+static int test_phase(void (*phase)(void), int mkfs, const char *extra) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fatal("fork failed");
+    }
+    if (pid == 0) {
+        test_mount(mkfs, extra);
+        phase();
+        my_oper.destroy(NULL);
+        fflush(stdout);
+        _exit(g_failures > 255 ? 255 : g_failures);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        printf("    mount process died (status %d)\n", status);
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// Stop the way a killed daemon would: nothing is flushed or checkpointed
+// and the image is left marked as in use.
+static void test_crash(void) {
+    fflush(stdout);
+    _exit(g_failures > 255 ? 255 : g_failures);
+}
+
+// The superblock as it is on disk right now, outside any mount.
+static Superblock test_superblock(void) {
+    Superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    int fd = open(FS_FILENAME, O_RDONLY);
+    if (fd < 0 || pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+        fatal("Cannot read the superblock");
+    }
+    close(fd);
+    return sb;
+}
+
+// Phases are separate processes; small numbers that later ones compare
+// against go through a file next to the image.
+static void test_save(const char *name, uint64_t value) {
+    FILE *f = fopen(name, "w");
+    if (f == NULL) {
+        fatal("Cannot save test state");
+    }
+    fprintf(f, "%llu\n", (unsigned long long)value);
+    fclose(f);
+}
+
+static uint64_t test_load(const char *name) {
+    unsigned long long value = 0;
+    FILE *f = fopen(name, "r");
+    if (f == NULL || fscanf(f, "%llu", &value) != 1) {
+        fatal("Cannot load test state");
+    }
+    fclose(f);
+    return value;
+}
+
+// ---------- File helpers ----------
+
+// What a file should contain. Bytes past size are never looked at.
+typedef struct {
+    uint8_t *data;
+    uint64_t size;
+    uint64_t cap;
+} Model;
+
+static uint8_t pattern(uint32_t seed, uint64_t off) {
+    uint64_t x = (off / 7 + seed) * 0x9E3779B97F4A7C15ULL;
+    return (uint8_t)(x >> 56) | 1;       // never zero, so holes stand out
+}
+
+static void model_resize(Model *m, uint64_t size) {
+    if (size > m->cap) {
+        m->data = realloc(m->data, size);
+        if (m->data == NULL) {
+            fatal("Out of memory");
+        }
+        memset(m->data + m->cap, 0, size - m->cap);
+        m->cap = size;
+    }
+    if (size < m->size) {
+        memset(m->data + size, 0, m->size - size);
+    }
+    m->size = size;
+}
+
+static int test_open(const char *path, int flags, struct fuse_file_info *fi) {
+    memset(fi, 0, sizeof(*fi));
+    fi->flags = flags;
+    return flags & O_CREAT ? my_oper.create(path, S_IFREG | 0644, fi) : my_oper.open(path, fi);
+}
+
+// The helpers below change a file and then its model m (if any). With
+// g_model_only set they skip the first part, so a phase after a remount
+// can rebuild the models by running the same steps again.
+
+// Write len bytes of pattern seed at off, through one handle and in
+// requests of at most TEST_IO_SIZE.
+static void test_write(const char *path, Model *m, uint32_t seed, uint64_t off, uint64_t len) {
+    static __thread uint8_t buf[TEST_IO_SIZE];
+    if (!g_model_only) {
+        struct fuse_file_info fi;
+        CHECK(test_open(path, O_CREAT | O_WRONLY, &fi) == 0);
+        for (uint64_t done = 0; done < len; ) {
+            size_t n = len - done < TEST_IO_SIZE ? len - done : TEST_IO_SIZE;
+            for (size_t i = 0; i < n; i++) {
+                buf[i] = pattern(seed, off + done + i);
+            }
+            int w = my_oper.write(path, (const char *)buf, n, off + done, &fi);
+            CHECK(w == (int)n);
+            done += n;
+        }
+        my_oper.release(path, &fi);
+    }
+    if (m != NULL) {
+        if (off + len > m->size) {
+            model_resize(m, off + len);
+        }
+        for (uint64_t i = 0; i < len; i++) {
+            m->data[off + i] = pattern(seed, off + i);
+        }
+    }
+}
+
+static void test_truncate(const char *path, Model *m, uint64_t size) {
+    if (!g_model_only) {
+        CHECK(my_oper.truncate(path, size, NULL) == 0);
+    }
+    if (m != NULL) {
+        model_resize(m, size);
+    }
+}
+
+// Punch a hole, keeping the size.
+static void test_punch(const char *path, Model *m, uint64_t off, uint64_t len) {
+    if (!g_model_only) {
+        int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        CHECK(my_oper.fallocate(path, mode, off, len, NULL) == 0);
+    }
+    if (m != NULL && off < m->size) {
+        memset(m->data + off, 0, m->size - off < len ? m->size - off : len);
+    }
+}
+
+// Create over an existing file, as open(O_CREAT | O_TRUNC) would; with
+// O_EXCL as well it has to fail and leave the file alone.
+static void test_recreate(const char *path, Model *m) {
+    if (!g_model_only) {
+        struct fuse_file_info fi;
+        CHECK(test_open(path, O_CREAT | O_EXCL | O_WRONLY, &fi) == -EEXIST);
+        CHECK(test_open(path, O_CREAT | O_TRUNC | O_WRONLY, &fi) == 0);
+        my_oper.release(path, &fi);
+    }
+    if (m != NULL) {
+        model_resize(m, 0);
+    }
+}
+
+static void test_unlink(const char *path) {
+    if (!g_model_only) {
+        CHECK(my_oper.unlink(path) == 0);
+    }
+}
+
+static void test_fsync(const char *path) {
+    struct fuse_file_info fi;
+    CHECK(test_open(path, O_RDONLY, &fi) == 0);
+    CHECK(my_oper.fsync(path, 0, &fi) == 0);
+    my_oper.release(path, &fi);
+}
+
+// Compare the whole file with m, reading in TEST_IO_SIZE requests at an
+// odd offset so they straddle blocks. Reports the first difference.
+static void test_expect(const char *path, const Model *m) {
+    static __thread uint8_t buf[TEST_IO_SIZE];
+    struct stat st;
+    int err = my_oper.getattr(path, &st, NULL);
+    if (err != 0 || (uint64_t)st.st_size != m->size) {
+        printf("    %s: getattr=%d size=%lld, expected size %llu\n", path, err,
+               err ? -1LL : (long long)st.st_size, (unsigned long long)m->size);
+        FAIL();
+        return;
+    }
+    struct fuse_file_info fi;
+    CHECK(test_open(path, O_RDONLY, &fi) == 0);
+    for (uint64_t off = 0; off < m->size || off == 0; ) {
+        size_t want = off == 0 ? 1000 : TEST_IO_SIZE;
+        int n = my_oper.read(path, (char *)buf, want, off, &fi);
+        size_t expect = m->size - off < want ? m->size - off : want;
+        if (n != (int)expect) {
+            printf("    %s: read at %llu returned %d, expected %zu\n", path,
+                   (unsigned long long)off, n, expect);
+            FAIL();
+            break;
+        }
+        if (memcmp(buf, m->data + off, n) != 0) {
+            size_t i = 0;
+            while (buf[i] == m->data[off + i]) {
+                i++;
+            }
+            printf("    %s: byte %llu is %u, expected %u\n", path,
+                   (unsigned long long)(off + i), buf[i], m->data[off + i]);
+            FAIL();
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        off += n;
+    }
+    my_oper.release(path, &fi);
+}
+
+static void test_absent(const char *path) {
+    struct stat st;
+    CHECK(my_oper.getattr(path, &st, NULL) == -ENOENT);
+}
+
+// utimens on path, once with both times set to now and once leaving
+// mtime alone; both have to return expect.
+static void test_touch(const char *path, int expect) {
+    struct timespec omit[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    CHECK(my_oper.utimens(path, NULL, NULL) == expect);
+    CHECK(my_oper.utimens(path, omit, NULL) == expect);
+}
+
+static uint64_t test_free_blocks(void) {
+    struct statvfs st;
+    CHECK(my_oper.statfs("/", &st) == 0);
+    return st.f_bfree;
+}
+
+
+static int test_count_dir(const char *path);
+
+// ---------- Cases ----------
+//
+// A case is a sequence of phases, each a mount of the same image. Steps
+// that later phases need to know about keep the models in file-scope
+// variables and sit in one function, which later phases run again with
+// g_model_only set.
+
+#define MB (1024 * 1024)
+
+// Sparse files: scattered writes, holes, punching, truncating across a
+// hole and extending again.
+
+static Model g_sparse;
+
+static void sparse_steps(void) {
+    const char *p = "/sparse";
+    test_write(p, &g_sparse, 1, 0, 1000);
+    test_write(p, &g_sparse, 2, 10 * BLOCK_SIZE + 100, BLOCK_SIZE);
+    test_write(p, &g_sparse, 3, 1 * MB, 64 * 1024);
+    test_write(p, &g_sparse, 4, 5 * MB - 10, 10);
+    test_punch(p, &g_sparse, 1 * MB + BLOCK_SIZE, 4 * BLOCK_SIZE);
+    test_punch(p, &g_sparse, 1 * MB + 8 * BLOCK_SIZE + 10, 100);
+    test_truncate(p, &g_sparse, 3 * MB + 123);
+    test_write(p, &g_sparse, 5, 3 * MB + 4000, 200);
+    test_truncate(p, &g_sparse, 4 * MB);
+}
+
+static void sparse_first(void) {
+    sparse_steps();
+    test_expect("/sparse", &g_sparse);
+
+    struct fuse_file_info fi;
+    CHECK(test_open("/sparse", O_RDONLY, &fi) == 0);
+    CHECK(my_oper.lseek("/sparse", 0, SEEK_HOLE, &fi) == BLOCK_SIZE);
+    CHECK(my_oper.lseek("/sparse", 20 * BLOCK_SIZE, SEEK_DATA, &fi) == 1 * MB);
+    CHECK(my_oper.lseek("/sparse", 1 * MB, SEEK_HOLE, &fi) == 1 * MB + BLOCK_SIZE);
+    CHECK(my_oper.lseek("/sparse", 1 * MB + BLOCK_SIZE, SEEK_DATA, &fi) == 1 * MB + 5 * BLOCK_SIZE);
+    CHECK(my_oper.lseek("/sparse", 3 * MB + 8192, SEEK_DATA, &fi) == -ENXIO);
+    my_oper.release("/sparse", &fi);
+}
+
+static void sparse_again(void) {
+    g_model_only = 1;
+    sparse_steps();
+    g_model_only = 0;
+    test_expect("/sparse", &g_sparse);
+}
+
+static int case_sparse(void) {
+    return test_phase(sparse_first, 1, "") + test_phase(sparse_again, 0, "");
+}
+
+// Fragmented files: two files written a block at a time in turn, one of
+// them only at even blocks, so both need an overflow chain several links
+// long. Then one is unlinked and the space it freed refilled by a third.
+
+#define FRAG_BLOCKS 1500
+
+static Model g_frag_a, g_frag_b, g_frag_c;
+
+static void frag_steps(void) {
+    for (uint32_t i = 0; i < FRAG_BLOCKS; i++) {
+        test_write("/a", &g_frag_a, 1, (uint64_t)2 * i * BLOCK_SIZE, BLOCK_SIZE);
+        test_write("/b", &g_frag_b, 2, (uint64_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+static uint32_t frag_extents(const char *path) {
+    int idx = lock_file_by_name(path, 0);
+    if (idx < 0) {
+        return 0;
+    }
+    uint32_t n = g_meta[idx].nextents;
+    pthread_rwlock_unlock(&g_file_locks[idx]);
+    return n;
+}
+
+static void frag_first(void) {
+    test_save("free", test_free_blocks());
+    frag_steps();
+    CHECK(frag_extents("/a") >= FRAG_BLOCKS);
+    CHECK(frag_extents("/b") > DIRECT_EXTENTS + OVERFLOW_EXTENTS);
+    test_expect("/a", &g_frag_a);
+    test_expect("/b", &g_frag_b);
+}
+
+static void frag_second(void) {
+    g_model_only = 1;
+    frag_steps();
+    g_model_only = 0;
+    test_expect("/a", &g_frag_a);
+    test_expect("/b", &g_frag_b);
+
+    uint64_t before = test_free_blocks();
+    test_unlink("/a");
+    CHECK(test_free_blocks() >= before + FRAG_BLOCKS);
+    test_absent("/a");
+    test_write("/c", &g_frag_c, 3, 0, FRAG_BLOCKS * BLOCK_SIZE);
+    test_expect("/b", &g_frag_b);
+    test_expect("/c", &g_frag_c);
+}
+
+static void frag_third(void) {
+    g_model_only = 1;
+    frag_steps();
+    test_write("/c", &g_frag_c, 3, 0, FRAG_BLOCKS * BLOCK_SIZE);
+    g_model_only = 0;
+    test_absent("/a");
+    test_expect("/b", &g_frag_b);
+    test_expect("/c", &g_frag_c);
+    test_unlink("/b");
+    test_unlink("/c");
+    CHECK(test_free_blocks() == test_load("free"));
+}
+
+static int case_fragment(void) {
+    return test_phase(frag_first, 1, "") + test_phase(frag_second, 0, "") +
+           test_phase(frag_third, 0, "");
+}
+
+// Truncate and reuse: blocks freed by a truncate go to another file, and
+// extending the first file again must read zeros, not that file's data.
+// Creating over a file truncates it too, unless O_EXCL refuses.
+
+static Model g_trunc_t, g_trunc_u, g_trunc_v, g_trunc_w, g_trunc_x;
+
+static void trunc_steps(void) {
+    test_write("/t", &g_trunc_t, 1, 0, 256 * 1024);
+    test_truncate("/t", &g_trunc_t, 5000);
+    test_write("/u", &g_trunc_u, 2, 0, 512 * 1024);
+    test_truncate("/t", &g_trunc_t, 300 * 1024);
+    test_write("/t", &g_trunc_t, 3, 100 * 1024 + 1, 10);
+    test_write("/v", &g_trunc_v, 4, 0, 200);
+    test_truncate("/v", &g_trunc_v, 0);
+    test_write("/v", &g_trunc_v, 5, 100 * 1024, 5000);
+    test_truncate("/u", &g_trunc_u, BLOCK_SIZE + 1);
+    test_truncate("/u", &g_trunc_u, 64 * 1024);
+    test_write("/w", &g_trunc_w, 6, 0, 3 * BLOCK_SIZE);
+    test_recreate("/w", &g_trunc_w);
+    test_write("/w", &g_trunc_w, 7, 2 * BLOCK_SIZE, 20);
+    test_write("/x", &g_trunc_x, 8, 0, 100);
+    test_recreate("/x", &g_trunc_x);
+}
+
+static void trunc_first(void) {
+    trunc_steps();
+    test_touch("/", 0);
+    test_touch(STATS_PATH, 0);
+    test_touch("/t", 0);
+    test_touch("/missing", -ENOENT);
+    test_expect("/t", &g_trunc_t);
+    test_expect("/u", &g_trunc_u);
+    test_expect("/v", &g_trunc_v);
+    test_expect("/w", &g_trunc_w);
+    test_expect("/x", &g_trunc_x);
+}
+
+static void trunc_again(void) {
+    g_model_only = 1;
+    trunc_steps();
+    g_model_only = 0;
+    test_expect("/t", &g_trunc_t);
+    test_expect("/u", &g_trunc_u);
+    test_expect("/v", &g_trunc_v);
+    test_expect("/w", &g_trunc_w);
+    test_expect("/x", &g_trunc_x);
+}
+
+static int case_truncate(void) {
+    return test_phase(trunc_first, 1, "") + test_phase(trunc_again, 0, "");
+}
+
+// Journal replay: metadata changes made durable with fsync and fsyncdir,
+// then the daemon stops without unmounting. The next mount has to replay
+// the journal and find exactly what was there, with no blocks leaked.
+
+#define REPLAY_FILES 100
+
+static Model g_replay_big, g_replay_small[REPLAY_FILES];
+
+static void replay_path(char *buf, size_t len, const char *dir, int i) {
+    snprintf(buf, len, "/%s/f%d", dir, i);
+}
+
+static void replay_steps(void) {
+    char path[64];
+    if (!g_model_only) {
+        CHECK(my_oper.mkdir("/d", 0755) == 0);
+        CHECK(my_oper.mkdir("/e", 0755) == 0);
+    }
+    for (int i = 0; i < REPLAY_FILES; i++) {
+        replay_path(path, sizeof(path), "d", i);
+        test_write(path, &g_replay_small[i], i, 0, 100 + i * 97);
+    }
+    test_write("/big", &g_replay_big, 1, 0, 1 * MB);
+    test_truncate("/big", &g_replay_big, 10000);
+    test_unlink("/d/f2");
+    if (!g_model_only) {
+        CHECK(my_oper.rename("/d/f1", "/e/g1", 0) == 0);
+        CHECK(my_oper.rename("/big", "/e/big", 0) == 0);
+    }
+}
+
+static void replay_first(void) {
+    test_save("free", test_free_blocks());
+    replay_steps();
+    test_fsync("/e/big");
+    test_fsync("/e/g1");
+    for (int i = 3; i < REPLAY_FILES; i++) {
+        char path[64];
+        replay_path(path, sizeof(path), "d", i);
+        test_fsync(path);
+    }
+    CHECK(my_oper.fsyncdir("/", 0, NULL) == 0);
+    test_crash();
+}
+
+static void replay_second(void) {
+    g_model_only = 1;
+    replay_steps();
+    g_model_only = 0;
+
+    char path[64];
+    test_absent("/big");
+    test_absent("/d/f1");
+    test_absent("/d/f2");
+    test_expect("/e/big", &g_replay_big);
+    test_expect("/e/g1", &g_replay_small[1]);
+    for (int i = 3; i < REPLAY_FILES; i++) {
+        replay_path(path, sizeof(path), "d", i);
+        test_expect(path, &g_replay_small[i]);
+    }
+    CHECK(test_count_dir("/d") == REPLAY_FILES - 2);
+
+    // Everything in the image is reachable from these, so removing them
+    // has to give all of it back.
+    test_unlink("/e/big");
+    test_unlink("/e/g1");
+    test_unlink("/d/f0");
+    for (int i = 3; i < REPLAY_FILES; i++) {
+        replay_path(path, sizeof(path), "d", i);
+        test_unlink(path);
+    }
+    CHECK(my_oper.rmdir("/d") == 0);
+    CHECK(my_oper.rmdir("/e") == 0);
+    CHECK(test_free_blocks() == test_load("free"));
+}
+
+static void replay_third(void) {
+    test_absent("/d");
+    test_absent("/e");
+    CHECK(test_count_dir("/") == 0);
+    CHECK(test_free_blocks() == test_load("free"));
+}
+
+static int case_replay(void) {
+    int failed = test_phase(replay_first, 1, "");
+    Superblock sb = test_superblock();
+    if (sb.clean) {
+        printf("    image marked clean after a crash\n");
+        failed++;
+    }
+    failed += test_phase(replay_second, 0, "");
+    sb = test_superblock();
+    if (!sb.clean) {
+        printf("    image not marked clean after unmounting\n");
+        failed++;
+    }
+    return failed + test_phase(replay_third, 0, "");
+}
+
+// Dedup: files written with the same whole blocks share them, and writing
+// to one of them, in part or whole blocks, copies only what it changes.
+// The index lives as long as a mount, so the later phase only checks that
+// what is still shared comes apart the same way.
+
+#define DEDUP_BLOCKS 64
+
+static Model g_dedup_x, g_dedup_y;
+
+static void dedup_steps(void) {
+    test_write("/x", &g_dedup_x, 7, 0, DEDUP_BLOCKS * BLOCK_SIZE);
+    test_write("/y", &g_dedup_y, 7, 0, DEDUP_BLOCKS * BLOCK_SIZE);
+    test_write("/y", &g_dedup_y, 8, 3 * BLOCK_SIZE + 100, 200);
+    test_write("/x", &g_dedup_x, 9, 10 * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+static void dedup_first(void) {
+    uint64_t base = test_free_blocks();
+    test_save("free", base);
+    test_write("/x", &g_dedup_x, 7, 0, DEDUP_BLOCKS * BLOCK_SIZE);
+    uint64_t one = test_free_blocks();
+    CHECK(base - one >= DEDUP_BLOCKS);
+    test_write("/y", &g_dedup_y, 7, 0, DEDUP_BLOCKS * BLOCK_SIZE);
+    CHECK(one - test_free_blocks() <= 1);
+    test_expect("/y", &g_dedup_y);
+
+    // Each overwrite below takes one block of its own, and leaves the
+    // other file reading what it had.
+    one = test_free_blocks();
+    test_write("/y", &g_dedup_y, 8, 3 * BLOCK_SIZE + 100, 200);
+    test_expect("/x", &g_dedup_x);
+    test_expect("/y", &g_dedup_y);
+    test_write("/x", &g_dedup_x, 9, 10 * BLOCK_SIZE, BLOCK_SIZE);
+    test_expect("/x", &g_dedup_x);
+    test_expect("/y", &g_dedup_y);
+    CHECK(one - test_free_blocks() == 2);
+}
+
+static void dedup_second(void) {
+    g_model_only = 1;
+    dedup_steps();
+    g_model_only = 0;
+    test_expect("/x", &g_dedup_x);
+    test_expect("/y", &g_dedup_y);
+
+    test_write("/y", &g_dedup_y, 10, 20 * BLOCK_SIZE, BLOCK_SIZE);
+    test_truncate("/x", &g_dedup_x, 30 * BLOCK_SIZE + 5);
+    test_expect("/x", &g_dedup_x);
+    test_expect("/y", &g_dedup_y);
+    test_unlink("/x");
+    test_expect("/y", &g_dedup_y);
+    test_unlink("/y");
+    CHECK(test_free_blocks() == test_load("free"));
+}
+
+static int case_dedup(void) {
+    return test_phase(dedup_first, 1, "dedup") + test_phase(dedup_second, 0, "dedup");
+}
+
+// Threads: writers on files of their own, readers on a shared file, and
+// a thread creating and unlinking small files, all at once.
+
+#define THREAD_WRITERS 4
+#define THREAD_READERS 2
+
+static Model g_thread_files[THREAD_WRITERS], g_thread_shared;
+
+static void thread_path(char *buf, size_t len, int i) {
+    snprintf(buf, len, "/w%d", i);
+}
+
+static void *thread_writer(void *arg) {
+    int i = (int)(intptr_t)arg;
+    char path[32];
+    thread_path(path, sizeof(path), i);
+    for (int round = 0; round < 8; round++) {
+        test_write(path, &g_thread_files[i], i * 16 + round,
+                   (uint64_t)round * 200 * 1024 + i * 1000, 300 * 1024);
+        if (round == 5) {
+            test_truncate(path, &g_thread_files[i], 700 * 1024 + 17);
+        }
+    }
+    return NULL;
+}
+
+static void *thread_reader(void *arg) {
+    (void)arg;
+    for (int round = 0; round < 10; round++) {
+        test_expect("/shared", &g_thread_shared);
+    }
+    return NULL;
+}
+
+static void *thread_churn(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 200; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/tmp%d", i % 10);
+        test_write(path, NULL, i, 0, 1 + i * 37 % 9000);
+        if (i % 10 == 9) {
+            for (int j = 0; j < 10; j++) {
+                snprintf(path, sizeof(path), "/tmp%d", j);
+                test_unlink(path);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void thread_steps(void) {
+    test_write("/shared", &g_thread_shared, 99, 0, 2 * MB + 5);
+    pthread_t threads[THREAD_WRITERS + THREAD_READERS + 1];
+    int n = 0;
+    if (g_model_only) {
+        for (int i = 0; i < THREAD_WRITERS; i++) {
+            thread_writer((void *)(intptr_t)i);
+        }
+        return;
+    }
+    for (int i = 0; i < THREAD_WRITERS; i++) {
+        pthread_create(&threads[n++], NULL, thread_writer, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < THREAD_READERS; i++) {
+        pthread_create(&threads[n++], NULL, thread_reader, NULL);
+    }
+    pthread_create(&threads[n++], NULL, thread_churn, NULL);
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void thread_check(void) {
+    char path[32];
+    for (int i = 0; i < THREAD_WRITERS; i++) {
+        thread_path(path, sizeof(path), i);
+        test_expect(path, &g_thread_files[i]);
+    }
+    test_expect("/shared", &g_thread_shared);
+    CHECK(test_count_dir("/") == THREAD_WRITERS + 1);
+}
+
+static void thread_first(void) {
+    thread_steps();
+    thread_check();
+}
+
+static void thread_again(void) {
+    g_model_only = 1;
+    thread_steps();
+    g_model_only = 0;
+    thread_check();
+}
+
+static int case_threads(void) {
+    return test_phase(thread_first, 1, "") + test_phase(thread_again, 0, "");
+}
+
+// ---------- Driver ----------
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off,
+                       enum fuse_fill_dir_flags flags) {
+    (void)st; (void)off; (void)flags;
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strcmp(name, STATS_PATH + 1) != 0) {
+        (*(int *)buf)++;
+    }
+    return 0;
+}
+
+// Entries in a directory, not counting . and .. or the stats file, or -1.
+static int test_count_dir(const char *path) {
+    int n = 0;
+    return my_oper.readdir(path, &n, count_entry, 0, NULL, 0) == 0 ? n : -1;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} g_cases[] = {
+    { "sparse",   case_sparse },
+    { "fragment", case_fragment },
+    { "truncate", case_truncate },
+    { "replay",   case_replay },
+    { "dedup",    case_dedup },
+    { "threads",  case_threads },
+};
+#define NCASES (sizeof(g_cases) / sizeof(g_cases[0]))
+
+static void usage(void) {
+    fprintf(stderr, "usage: test_fs [-o mount options] [case ...]\n");
+    exit(EXIT_FAILURE);
+}
+
+// Run one case on a fresh image in a scratch directory of its own.
+static int test_run(int c) {
+    char dir[] = "/tmp/test_fs.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        fatal("Cannot set up a scratch directory");
+    }
+    printf("%-8s [%s]\n", g_cases[c].name, g_test_opts);
+    int failed = g_cases[c].run();
+    printf("%-8s [%s] %s\n", g_cases[c].name, g_test_opts, failed ? "FAILED" : "ok");
+    unlink(FS_FILENAME);
+    unlink("free");
+    chdir("/");
+    rmdir(dir);
+    return failed != 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *opts = NULL;
+    int wanted[NCASES] = { 0 };
+    int any = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (++i >= argc) {
+                usage();
+            }
+            opts = argv[i];
+            continue;
+        }
+        size_t c = 0;
+        while (c < NCASES && strcmp(argv[i], g_cases[c].name) != 0) {
+            c++;
+        }
+        if (c == NCASES) {
+            usage();
+        }
+        wanted[c] = any = 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    int failed = 0;
+    for (size_t o = 0; o < (opts ? 1 : NDEFAULT_OPTS); o++) {
+        g_test_opts = opts ? opts : g_default_opts[o];
+        for (size_t c = 0; c < NCASES; c++) {
+            if (!any || wanted[c]) {
+                failed += test_run(c);
+            }
+        }
+    }
+    printf("%d failed\n", failed);
+    return failed;
+}
@@ -3,7 +3,7 @@
 # Test script for FUSE filesystem
 
 MOUNT_POINT="/tmp/myfuse"
-FS_PATH="/home/sahab/Desktop/FUSE"
+FS_PATH="$(cd "$(dirname "$0")" && pwd)"   # the directory holding main_fs
 
 echo "=== FUSE Filesystem Test ==="
 echo ""
@@ -14,7 +14,9 @@ mkdir -p "$MOUNT_POINT"
 # Mount the filesystem in background
 echo "Mounting FUSE filesystem at $MOUNT_POINT..."
 cd "$FS_PATH"
-./main_fs "$MOUNT_POINT" &
+MKFS=""
+[ -f filesys.db ] || MKFS="-o mkfs"
+./main_fs $MKFS "$MOUNT_POINT" &
 FS_PID=$!
 
 # Wait for mount
@@ -39,6 +41,15 @@ if mount | grep -q "$MOUNT_POINT"; then
     cat "$MOUNT_POINT/test.txt"
     echo ""
     
+    # Directories
+    echo "Creating and renaming a directory..."
+    mkdir "$MOUNT_POINT/docs"
+    echo "nested" > "$MOUNT_POINT/docs/note.txt"
+    mv "$MOUNT_POINT/docs" "$MOUNT_POINT/notes"
+    ls -la "$MOUNT_POINT/notes"
+    cat "$MOUNT_POINT/notes/note.txt"
+    echo ""
+
     # Show filesystem stats
     echo "Filesystem stats:"
     df "$MOUNT_POINT"